@@ -28,33 +28,56 @@ HWC2::Error Backend::ValidateDisplay(HwcDisplay *display, uint32_t *num_types,
   *num_types = 0;
   *num_requests = 0;
 
-  auto layers = display->GetOrderLayersByZPos();
+  auto &layers = display->GetOrderLayersByZPos();
 
   int client_start = -1;
   size_t client_size = 0;
 
+  if (display->GetPipe().atomic_state_manager->ConsumeCompositionFailure()) {
+    /* The last composition was rejected by the kernel despite passing the
+     * test, let the client compose the next frame */
+    MarkValidated(layers, 0, layers.size());
+    *num_types = layers.size();
+    return *num_types != 0 ? HWC2::Error::HasChanges : HWC2::Error::None;
+  }
+
   auto flatcon = display->GetFlatCon();
   if (flatcon) {
-    bool should_flatten = false;
-    if (layers.size() <= 1)
+    /* Single layer isn't worth flattening, but the idle refresh still needs
+     * the idle detection */
+    bool idle = false;
+    if (layers.size() <= 1 && display->GetIdleConfigId() == 0)
       flatcon->Disable();
     else
-      should_flatten = flatcon->NewFrame();
+      idle = flatcon->NewFrame();
 
-    if (should_flatten) {
+    display->SetIdleRefresh(idle);
+
+    if (idle && layers.size() > 1) {
       display->total_stats().frames_flattened_++;
-      MarkValidated(layers, 0, layers.size());
-      *num_types = layers.size();
-      return HWC2::Error::HasChanges;
+      /* Writeback connector flattens the frame presented as usual */
+      if (!display->RequestWritebackFlattening()) {
+        AccountClientFlattening(display, layers);
+        MarkValidated(layers, 0, layers.size());
+        *num_types = layers.size();
+        return HWC2::Error::HasChanges;
+      }
     }
   }
 
   std::tie(client_start, client_size) = GetClientLayers(display, layers);
 
+  const bool same_types = IsMarkedValidated(layers, client_start,
+                                            client_size);
   MarkValidated(layers, client_start, client_size);
 
   auto testing_needed = client_start != 0 || client_size != layers.size();
 
+  /* Only new buffers for the layers composed as before */
+  if (testing_needed && same_types && display->ReusePresentedComposition()) {
+    testing_needed = false;
+  }
+
   AtomicCommitArgs a_args = {.test_only = true};
 
   if (testing_needed &&
@@ -87,6 +110,17 @@ std::tuple<int, size_t> Backend::GetClientLayers(
     }
   }
 
+  auto flatcon = display->GetFlatCon();
+  if (client_start < 0 && flatcon) {
+    /* Static part of the stack is composed by the client once, the client
+     * reuses the result while the layers stay static */
+    std::tie(client_start, client_size) = GetStaticLayers(
+        layers, flatcon->GetTimeoutNs());
+    if (client_start >= 0) {
+      display->total_stats().frames_partially_flattened_++;
+    }
+  }
+
   return GetExtraClientRange(display, layers, client_start, client_size);
 }
 
@@ -102,6 +136,59 @@ bool Backend::HardwareSupportsLayerType(HWC2::Composition comp_type) {
          comp_type == HWC2::Composition::Cursor;
 }
 
+std::tuple<int, size_t> Backend::GetStaticLayers(
+    const std::vector<HwcLayer *> &layers, int64_t timeout_ns) {
+  const int64_t now_ns = ResourceManager::GetTimeMonotonicNs();
+
+  int best_start = -1;
+  size_t best_size = 0;
+  size_t run_start = 0;
+  for (size_t z_order = 0; z_order <= layers.size(); ++z_order) {
+    /* Composition type requests don't update the content */
+    if (z_order < layers.size() &&
+        (layers[z_order]->GetChangedProperties() &
+         ~HwcLayer::kCompositionType) == 0 &&
+        now_ns - layers[z_order]->GetLastUpdateNs() >= timeout_ns) {
+      continue;
+    }
+
+    const size_t run_size = z_order - run_start;
+    if (run_size > best_size) {
+      best_start = int(run_start);
+      best_size = run_size;
+    }
+    run_start = z_order + 1;
+  }
+
+  /* Single layer takes a plane anyway, the whole stack is left to the
+   * flattening controller */
+  if (best_size < 2 || best_size == layers.size()) {
+    return std::make_tuple(-1, 0);
+  }
+
+  return std::make_tuple(best_start, best_size);
+}
+
+void Backend::AccountClientFlattening(HwcDisplay *display,
+                                      const std::vector<HwcLayer *> &layers) {
+  hwc2_config_t config = 0;
+  int32_t width = 0;
+  int32_t height = 0;
+  uint32_t period_ns = 0;
+  display->GetActiveConfig(&config);
+  display->GetDisplayAttribute(config, int32_t(HWC2::Attribute::Width),
+                               &width);
+  display->GetDisplayAttribute(config, int32_t(HWC2::Attribute::Height),
+                               &height);
+  display->GetDisplayVsyncPeriod(&period_ns);
+
+  /* Scanout of all the planes is replaced by the client framebuffer */
+  const uint64_t pixops = CalcPixOps(layers, 0, layers.size());
+  const uint64_t fb_pixops = uint64_t(width) * uint64_t(height);
+  const uint64_t saved = pixops > fb_pixops ? pixops - fb_pixops : 0;
+  display->GetFlatCon()->ClientFlattened(pixops, saved, period_ns);
+}
+
 uint32_t Backend::CalcPixOps(const std::vector<HwcLayer *> &layers,
                              size_t first_z, size_t size) {
   uint32_t pixops = 0;
@@ -124,11 +211,24 @@ void Backend::MarkValidated(std::vector<HwcLayer *> &layers,
   }
 }
 
+bool Backend::IsMarkedValidated(const std::vector<HwcLayer *> &layers,
+                                size_t client_first_z, size_t client_size) {
+  for (size_t z_order = 0; z_order < layers.size(); ++z_order) {
+    auto type = z_order >= client_first_z &&
+                        z_order < client_first_z + client_size
+                    ? HWC2::Composition::Client
+                    : HWC2::Composition::Device;
+    if (layers[z_order]->GetValidatedType() != type) {
+      return false;
+    }
+  }
+  return true;
+}
+
 std::tuple<int, int> Backend::GetExtraClientRange(
     HwcDisplay *display, const std::vector<HwcLayer *> &layers,
     int client_start, size_t client_size) {
-  auto planes = display->GetPipe().GetUsablePlanes();
-  size_t avail_planes = planes.size();
+  size_t avail_planes = display->CountUsablePlanes();
 
   /*
    * If more layers then planes, save one plane
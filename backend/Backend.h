@@ -31,10 +31,18 @@ class Backend {
 
  protected:
   static bool HardwareSupportsLayerType(HWC2::Composition comp_type);
+  static void AccountClientFlattening(HwcDisplay *display,
+                                      const std::vector<HwcLayer *> &layers);
   static uint32_t CalcPixOps(const std::vector<HwcLayer *> &layers,
                              size_t first_z, size_t size);
   static void MarkValidated(std::vector<HwcLayer *> &layers,
                             size_t client_first_z, size_t client_size);
+  /* Layers are already marked so by the prior frame */
+  static bool IsMarkedValidated(const std::vector<HwcLayer *> &layers,
+                                size_t client_first_z, size_t client_size);
+  /* Longest run of the layers not updated for |timeout_ns| */
+  static std::tuple<int, size_t> GetStaticLayers(
+      const std::vector<HwcLayer *> &layers, int64_t timeout_ns);
   static std::tuple<int, int> GetExtraClientRange(
       HwcDisplay *display, const std::vector<HwcLayer *> &layers,
       int client_start, size_t client_size);
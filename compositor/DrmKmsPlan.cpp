@@ -23,37 +23,40 @@
 #include "utils/log.h"
 
 namespace android {
-auto DrmKmsPlan::CreateDrmKmsPlan(DrmDisplayPipeline &pipe,
-                                  std::vector<LayerData> composition)
-    -> std::unique_ptr<DrmKmsPlan> {
-  auto plan = std::make_unique<DrmKmsPlan>();
-
-  auto avail_planes = pipe.GetUsablePlanes();
+auto DrmKmsPlan::Update(DrmDisplayPipeline &pipe,
+                        std::vector<LayerData> &composition) -> bool {
+  plan.clear();
+  pipe.GetUsablePlanes(avail_planes_);
 
+  size_t next_plane = 0;
   int z_pos = 0;
   for (auto &dhl : composition) {
-    std::shared_ptr<BindingOwner<DrmPlane>> plane;
+    std::shared_ptr<BindingOwner<DrmPlane>> *plane = nullptr;
 
     /* Skip unsupported planes */
     do {
-      if (avail_planes.empty()) {
-        return {};
+      if (next_plane >= avail_planes_.size()) {
+        plan.clear();
+        avail_planes_.clear();
+        return false;
       }
 
-      plane = *avail_planes.begin();
-      avail_planes.erase(avail_planes.begin());
-    } while (!plane->Get()->IsValidForLayer(&dhl));
+      plane = &avail_planes_[next_plane++];
+    } while (!(*plane)->Get()->IsValidForLayer(&dhl));
 
     LayerToPlaneJoining joining = {
         .layer = std::move(dhl),
-        .plane = plane,
+        .plane = std::move(*plane),
         .z_pos = z_pos++,
     };
 
-    plan->plan.emplace_back(std::move(joining));
+    plan.emplace_back(std::move(joining));
   }
 
-  return plan;
+  /* Release the planes which are not used by this plan */
+  avail_planes_.clear();
+
+  return true;
 }
 
 }  // namespace android
@@ -34,9 +34,16 @@ struct DrmKmsPlan {
 
   std::vector<LayerToPlaneJoining> plan;
 
-  static auto CreateDrmKmsPlan(DrmDisplayPipeline &pipe,
-                               std::vector<LayerData> composition)
-      -> std::unique_ptr<DrmKmsPlan>;
+  /* Rebuilds the plan in-place, moving layers out of the |composition|.
+   * Storage is kept between the frames, so that steady-state frames do not
+   * allocate. Returns false and leaves the plan empty if some layer can't be
+   * assigned to a plane.
+   */
+  auto Update(DrmDisplayPipeline &pipe, std::vector<LayerData> &composition)
+      -> bool;
+
+ private:
+  std::vector<std::shared_ptr<BindingOwner<DrmPlane>>> avail_planes_;
 };
 
 }  // namespace android
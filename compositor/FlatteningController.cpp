@@ -25,74 +25,163 @@
  * other CRTCs.
  *
  * If the client is not updating layers for 1 second, FlatCon triggers a
- * callback to refresh the screen. The compositor should mark all layers to be
- * composed by the client into a single framebuffer using GPU.
+ * callback to refresh the screen from the shared TimerService thread. The
+ * compositor should mark all layers to be composed by the client into a single
+ * framebuffer using GPU.
  */
 
 #define LOG_TAG "hwc-flatcon"
 
 #include "FlatteningController.h"
 
+#include <algorithm>
+#include <cinttypes>
+
 #include "utils/log.h"
 
 namespace android {
 
-auto FlatteningController::CreateInstance(FlatConCallbacks &cbks)
+auto FlatteningController::CreateInstance(
+    FlatConCallbacks &cbks, std::shared_ptr<TimerService> timer_service)
     -> std::shared_ptr<FlatteningController> {
+  if (!timer_service) {
+    return {};
+  }
+
   auto fc = std::shared_ptr<FlatteningController>(new FlatteningController());
 
   fc->cbks_ = cbks;
-
-  std::thread(&FlatteningController::ThreadFn, fc).detach();
+  fc->self_ = fc;
+  fc->timer_service_ = std::move(timer_service);
 
   return fc;
 }
 
 /* Compositor should call this every frame */
 bool FlatteningController::NewFrame() {
-  bool wake_it = false;
-  auto lock = std::lock_guard<std::mutex>(mutex_);
-
-  if (flatten_next_frame_) {
-    flatten_next_frame_ = false;
+  const int64_t now_ns = TimerService::GetTimeNs();
+  if (flatten_next_frame_.exchange(false)) {
     return true;
   }
 
-  sleep_until_ = std::chrono::system_clock::now() + kTimeout;
-  if (disabled_) {
-    wake_it = true;
-    disabled_ = false;
+  if (flattened_ns_ != 0) {
+    LearnFromFlattening(now_ns);
+    flattened_ns_ = 0;
+  }
+  last_frame_ns_ = now_ns;
+
+  const int64_t deadline_ns = now_ns + timeout_ns_;
+  deadline_ns_ = deadline_ns;
+
+  if (!disabled_.exchange(false) && armed_) {
+    /* The running timer picks the new deadline up */
+    return false;
   }
 
-  if (wake_it)
-    cv_.notify_all();
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (timer_id_ != 0 || !cbks_.trigger) {
+    return false;
+  }
 
+  Arm(deadline_ns);
   return false;
 }
 
-void FlatteningController::ThreadFn(
-    const std::shared_ptr<FlatteningController> &fc) {
-  for (;;) {
-    std::unique_lock<std::mutex> lock(fc->mutex_);
-    if (fc.use_count() == 1 || !fc->cbks_.trigger)
-      break;
-
-    if (fc->sleep_until_ <= std::chrono::system_clock::now() &&
-        !fc->disabled_) {
-      fc->disabled_ = true;
-      fc->flatten_next_frame_ = true;
-      ALOGV("Timeout. Sending an event to compositor");
-      fc->cbks_.trigger();
-    }
-
-    if (fc->disabled_) {
-      ALOGV("Wait");
-      fc->cv_.wait(lock);
-    } else {
-      ALOGV("Wait_until");
-      fc->cv_.wait_until(lock, fc->sleep_until_);
-    }
+void FlatteningController::ClientFlattened(uint64_t gpu_pixops,
+                                           uint64_t saved_pixops,
+                                           int64_t period_ns) {
+  constexpr int64_t kMaxTimeoutNs = std::chrono::nanoseconds(kMaxTimeout)
+                                        .count();
+  flattened_ns_ = TimerService::GetTimeNs();
+  stats_.flattens++;
+
+  /* Refreshes needed to save as many pixel operations as the GPU spent */
+  const uint64_t refreshes = saved_pixops != 0
+                                 ? gpu_pixops / saved_pixops + 1
+                                 : UINT64_MAX;
+  const uint64_t max_refreshes = period_ns > 0 ? kMaxTimeoutNs / period_ns
+                                               : 0;
+  payoff_ns_ = refreshes < max_refreshes ? int64_t(refreshes) * period_ns
+                                         : kMaxTimeoutNs;
+}
+
+void FlatteningController::LearnFromFlattening(int64_t time_ns) {
+  constexpr int64_t kMinTimeoutNs = std::chrono::nanoseconds(kMinTimeout)
+                                        .count();
+  constexpr int64_t kMaxTimeoutNs = std::chrono::nanoseconds(kMaxTimeout)
+                                        .count();
+  /* Static this many timeouts after flattening, try flattening sooner */
+  constexpr int kShrinkAfterTimeouts = 4;
+
+  const int64_t flattened_for_ns = time_ns - flattened_ns_;
+  const int64_t idle_gap_ns = time_ns - last_frame_ns_;
+  /* Waiting as long as the flattening costs bounds the waste by the cost */
+  const int64_t min_timeout_ns = std::max(kMinTimeoutNs, payoff_ns_);
+
+  if (flattened_for_ns < std::max(timeout_ns_, payoff_ns_)) {
+    stats_.wasted++;
+    timeout_ns_ = std::min(std::max({timeout_ns_ * 2,
+                                     idle_gap_ns + idle_gap_ns / 4,
+                                     min_timeout_ns}),
+                           kMaxTimeoutNs);
+    constexpr int64_t kNsInMs = 1000000;
+    ALOGV("Flattening undone after %" PRId64 " ms, timeout %" PRId64 " ms",
+          flattened_for_ns / kNsInMs, timeout_ns_ / kNsInMs);
+  } else if (flattened_for_ns > timeout_ns_ * kShrinkAfterTimeouts) {
+    timeout_ns_ = std::max(timeout_ns_ - timeout_ns_ / 4, min_timeout_ns);
+  }
+}
+
+void FlatteningController::Arm(int64_t deadline_ns) {
+  timer_id_ = timer_service_->Schedule(
+      deadline_ns, [weak_fc = self_](int64_t time_ns) {
+        auto fc = weak_fc.lock();
+        if (fc) {
+          fc->OnTimer(time_ns);
+        }
+      });
+  armed_ = true;
+}
+
+void FlatteningController::OnTimer(int64_t time_ns) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  timer_id_ = 0;
+
+  if (disabled_ || !cbks_.trigger) {
+    armed_ = false;
+    return;
+  }
+
+  if (deadline_ns_ > time_ns) {
+    /* Frames arrived meanwhile */
+    Arm(deadline_ns_);
+    return;
+  }
+
+  /* Frames from now on take the locked path of NewFrame(). A frame which
+   * took the lock-free path has moved the deadline before, re-check it. */
+  disabled_ = true;
+  if (deadline_ns_ > time_ns) {
+    disabled_ = false;
+    Arm(deadline_ns_);
+    return;
+  }
+
+  armed_ = false;
+  flatten_next_frame_ = true;
+  ALOGV("Timeout. Sending an event to compositor");
+  /* Called under the lock, so Stop() guarantees no more calls */
+  cbks_.trigger();
+}
+
+void FlatteningController::Stop() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  cbks_ = {};
+  if (timer_id_ != 0) {
+    timer_service_->Cancel(timer_id_);
+    timer_id_ = 0;
   }
+  armed_ = false;
 }
 
 }  // namespace android
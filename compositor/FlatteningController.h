@@ -16,27 +16,46 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
-#include <condition_variable>
+#include <cstdint>
 #include <functional>
-#include <thread>
+#include <memory>
+#include <mutex>
+
+#include "utils/TimerService.h"
 
 namespace android {
 
 // NOLINTNEXTLINE(misc-unused-using-decls): False positive
 using std::chrono_literals::operator""s;
+// NOLINTNEXTLINE(misc-unused-using-decls): False positive
+using std::chrono_literals::operator""ms;
 
 struct FlatConCallbacks {
   std::function<void()> trigger;
 };
 
+/* Idle deadlines of all the displays are served by the shared TimerService.
+ * NewFrame() only moves the deadline, the timer re-arms itself to the moved
+ * deadline once it expires.
+ *
+ * Timeout adapts to the update cadence of the display. Flattening pays off
+ * once the scanout it saves outweighs the GPU pass, which takes longer the
+ * fewer planes it merges. Flattening undone sooner than that, or sooner than
+ * the timeout, wasted the GPU pass, so the timeout grows beyond the idle gap
+ * which caused it. Long static periods after flattening let the timeout
+ * shrink back, but never below the payoff time.
+ */
 class FlatteningController {
  public:
-  static auto CreateInstance(FlatConCallbacks &cbks)
+  static auto CreateInstance(FlatConCallbacks &cbks,
+                             std::shared_ptr<TimerService> timer_service)
       -> std::shared_ptr<FlatteningController>;
 
   void Disable() {
-    auto lock = std::lock_guard<std::mutex>(mutex_);
+    /* Not while the timer decides to flatten, see OnTimer() */
+    const std::lock_guard<std::mutex> lock(mutex_);
     flatten_next_frame_ = false;
     disabled_ = true;
   }
@@ -44,27 +63,67 @@ class FlatteningController {
   /* Compositor should call this every frame */
   bool NewFrame();
 
+  /* Compositor should call this when the client composes the flattened frame.
+   * |gpu_pixops| is the cost of the client pass, |saved_pixops| the scanout
+   * saved by each refresh of the flattened frame. */
+  void ClientFlattened(uint64_t gpu_pixops, uint64_t saved_pixops,
+                       int64_t period_ns);
+
   auto ShouldFlatten() const {
-    return flatten_next_frame_;
+    return flatten_next_frame_.load();
+  }
+
+  void Stop();
+
+  /* Learned idle timeout, called with the display lock held as NewFrame() */
+  auto GetTimeoutNs() const {
+    return timeout_ns_;
   }
 
-  void StopThread() {
-    auto lock = std::lock_guard<std::mutex>(mutex_);
-    cbks_ = {};
-    cv_.notify_all();
+  struct Stats {
+    /* Composed by the client */
+    uint32_t flattens;
+    /* Undone by an update before it paid off */
+    uint32_t wasted;
+  };
+
+  auto GetStats() const {
+    return stats_;
   }
 
   static constexpr auto kTimeout = 1s;
+  static constexpr auto kMinTimeout = 500ms;
+  static constexpr auto kMaxTimeout = 10s;
 
  private:
   FlatteningController() = default;
-  static void ThreadFn(const std::shared_ptr<FlatteningController> &fc);
 
-  bool flatten_next_frame_{};
-  bool disabled_{};
-  decltype(std::chrono::system_clock::now()) sleep_until_{};
+  /* Called with mutex_ held */
+  void Arm(int64_t deadline_ns);
+  void OnTimer(int64_t time_ns);
+
+  /* Accounts the flattening undone by the frame at |time_ns| */
+  void LearnFromFlattening(int64_t time_ns);
+
+  /* Owned by the compositor thread */
+  int64_t timeout_ns_ = std::chrono::nanoseconds(kTimeout).count();
+  int64_t last_frame_ns_{};
+  int64_t flattened_ns_{};
+  /* Static time needed for the last flattening to pay off */
+  int64_t payoff_ns_{};
+  Stats stats_{};
+
+  std::atomic_bool flatten_next_frame_{};
+  std::atomic_bool disabled_{true};
+  std::atomic<int64_t> deadline_ns_{};
+  /* Mirrors timer_id_ != 0 for the lock-free check of NewFrame() */
+  std::atomic_bool armed_{};
+
+  std::weak_ptr<FlatteningController> self_;
+  std::shared_ptr<TimerService> timer_service_;
+
   std::mutex mutex_;
-  std::condition_variable cv_;
+  TimerService::TimerId timer_id_{};
   FlatConCallbacks cbks_;
 };
 
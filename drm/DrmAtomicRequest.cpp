@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-atomic-request"
+
+#include "DrmAtomicRequest.h"
+
+#include <xf86drmMode.h>
+
+#include <cerrno>
+
+#include "utils/log.h"
+
+namespace android {
+
+auto DrmAtomicRequest::CreateInstance() -> std::unique_ptr<DrmAtomicRequest> {
+  auto req = std::unique_ptr<DrmAtomicRequest>(new DrmAtomicRequest());
+
+  req->pset_ = MakeDrmModeAtomicReqUnique();
+  if (!req->pset_) {
+    ALOGE("Failed to allocate property set");
+    return {};
+  }
+
+  return req;
+}
+
+void DrmAtomicRequest::Reset() {
+  SetCursor(0);
+  request_no_++;
+}
+
+auto DrmAtomicRequest::Add(uint32_t obj_id, uint32_t prop_id, uint64_t value,
+                           bool one_shot) -> int {
+  ShadowEntry *entry = nullptr;
+  if (!one_shot) {
+    entry = &shadow_[{obj_id, prop_id}];
+
+    /* Value already added to this request has to be overridden, even if the
+     * new value matches the committed one */
+    const bool in_request = entry->request_no == request_no_;
+    if (entry->committed && entry->value == value && !in_request) {
+      return 0;
+    }
+
+    entry->request_no = request_no_;
+  }
+
+  auto err = drmModeAtomicAddProperty(pset_.get(), obj_id, prop_id, value);
+  if (err < 0) {
+    return err;
+  }
+
+  items_.emplace_back(Item{.entry = entry, .value = value});
+  return 0;
+}
+
+auto DrmAtomicRequest::Commit(int fd, uint32_t flags, void *user_data) -> int {
+  auto err = drmModeAtomicCommit(fd, pset_.get(), flags, user_data);
+  ApplyCommitResult(flags, err);
+  return err;
+}
+
+auto DrmAtomicRequest::AppendTo(drmModeAtomicReq *req) const -> int {
+  return drmModeAtomicMerge(req, pset_.get());
+}
+
+void DrmAtomicRequest::ApplyCommitResult(uint32_t flags, int err) {
+  if ((flags & DRM_MODE_ATOMIC_TEST_ONLY) != 0) {
+    return;
+  }
+
+  if (err != 0) {
+    /* -EBUSY is returned before the state is touched, otherwise the kernel
+     * state is unknown now */
+    if (err != -EBUSY) {
+      InvalidateShadow();
+    }
+    return;
+  }
+
+  for (auto &item : items_) {
+    if (item.entry != nullptr) {
+      item.entry->value = item.value;
+      item.entry->committed = true;
+    }
+  }
+}
+
+void DrmAtomicRequest::SetCursor(int cursor) {
+  drmModeAtomicSetCursor(pset_.get(), cursor);
+  items_.resize(cursor);
+}
+
+void DrmAtomicRequest::InvalidateShadow() {
+  for (auto &entry : shadow_) {
+    entry.second.committed = false;
+  }
+}
+
+void DrmAtomicRequest::InvalidateShadow(uint32_t obj_id) {
+  for (auto it = shadow_.lower_bound({obj_id, 0});
+       it != shadow_.end() && it->first.first == obj_id; ++it) {
+    it->second.committed = false;
+  }
+}
+
+}  // namespace android
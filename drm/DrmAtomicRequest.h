@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "drm/DrmUnique.h"
+
+namespace android {
+
+/* Atomic property set which keeps a shadow copy of the values committed by
+ * the prior requests. Properties already holding the requested value are not
+ * added, so that the kernel has to validate only what has changed.
+ */
+class DrmAtomicRequest {
+ public:
+  static auto CreateInstance() -> std::unique_ptr<DrmAtomicRequest>;
+
+  /* Starts a new request, keeping the allocated storage */
+  void Reset();
+
+  /* |one_shot| properties are consumed by the commit (fences, writeback
+   * buffers) and are never skipped.
+   */
+  auto Add(uint32_t obj_id, uint32_t prop_id, uint64_t value, bool one_shot)
+      -> int;
+
+  /* Updates the shadow on success and drops it on failure */
+  auto Commit(int fd, uint32_t flags, void *user_data) -> int;
+
+  /* Request can be committed as a part of the bigger one. The result has to
+   * be reported back using ApplyCommitResult() then. */
+  auto AppendTo(drmModeAtomicReq *req) const -> int;
+  void ApplyCommitResult(uint32_t flags, int err);
+
+  auto GetCursor() const -> int {
+    return int(items_.size());
+  }
+
+  /* Drops the properties added after the |cursor| */
+  void SetCursor(int cursor);
+
+  /* Next request will contain the full state */
+  void InvalidateShadow();
+  /* Next request will contain all properties of the object */
+  void InvalidateShadow(uint32_t obj_id);
+
+ private:
+  DrmAtomicRequest() = default;
+
+  struct ShadowEntry {
+    uint64_t value{};
+    bool committed{};
+    /* Set to request_no_ when the property is added to the request */
+    uint32_t request_no{};
+  };
+
+  struct Item {
+    ShadowEntry *entry;
+    uint64_t value;
+  };
+
+  DrmModeAtomicReqUnique pset_;
+
+  /* (object id, property id) -> last committed value */
+  std::map<std::pair<uint32_t, uint32_t>, ShadowEntry> shadow_;
+  std::vector<Item> items_;
+  uint32_t request_no_ = 1;
+};
+
+}  // namespace android
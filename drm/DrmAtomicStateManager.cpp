@@ -22,17 +22,35 @@
 #include "DrmAtomicStateManager.h"
 
 #include <drm/drm_mode.h>
+#include <linux/types.h>
 #include <sync/sync.h>
+#include <sys/ioctl.h>
 #include <utils/Trace.h>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <thread>
+#include <utility>
 
+#include "drm/DrmCommitAggregator.h"
 #include "drm/DrmCrtc.h"
 #include "drm/DrmDevice.h"
+#include "drm/DrmEventListener.h"
 #include "drm/DrmPlane.h"
 #include "drm/DrmUnique.h"
 #include "utils/log.h"
 
+/* SYNC_IOC_SET_DEADLINE, available since Linux 6.3 */
+struct SyncSetDeadline {
+  __u64 deadline_ns; /* CLOCK_MONOTONIC */
+  __u64 pad;
+};
+
+// NOLINTNEXTLINE(readability-magic-numbers)
+constexpr unsigned long kSyncIocSetDeadline = _IOW('>' /*SYNC_IOC_MAGIC*/, 5,
+                                                  SyncSetDeadline);
+
 namespace android {
 
 auto DrmAtomicStateManager::CreateInstance(DrmDisplayPipeline *pipe)
@@ -41,52 +59,65 @@ auto DrmAtomicStateManager::CreateInstance(DrmDisplayPipeline *pipe)
       new DrmAtomicStateManager());
 
   dasm->pipe_ = pipe;
-  std::thread(&DrmAtomicStateManager::ThreadFn, dasm.get(), dasm).detach();
+  dasm->self_ = dasm;
+
+  auto &resman = pipe->device->GetResMan();
+  dasm->resman_ = &resman;
+  pipe->device->GetEventListener().RegisterFlipHandler(
+      pipe->crtc->Get()->GetId(),
+      [weak_dasm = std::weak_ptr<DrmAtomicStateManager>(dasm)](
+          uint32_t sequence, int64_t timestamp_ns) {
+        auto dasm = weak_dasm.lock();
+        if (dasm) {
+          dasm->OnPageFlip(sequence, timestamp_ns);
+        }
+      });
+
+  dasm->release_timeline_ = SwSyncTimeline::CreateInstance("hwc-release");
+  if (resman.IsAsyncCommitEnabled()) {
+    dasm->present_timeline_ = SwSyncTimeline::CreateInstance("hwc-present");
+    if (resman.IsMultiCrtcCommitEnabled() && dasm->present_timeline_) {
+      dasm->aggregator_ = pipe->device->GetCommitAggregator();
+    }
+
+    if (dasm->aggregator_) {
+      dasm->aggregator_->AddMember(dasm.get());
+    } else if (dasm->present_timeline_) {
+      std::thread(&DrmAtomicStateManager::CommitThreadFn, dasm.get(), dasm)
+          .detach();
+    } else {
+      ALOGW("sw_sync is not available, falling back to synchronous commit");
+    }
+  }
 
   return dasm;
 }
 
 // NOLINTNEXTLINE (readability-function-cognitive-complexity): Fixme
-auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
-  // NOLINTNEXTLINE(misc-const-correctness)
-  ATRACE_CALL();
-
-  if (args.active && *args.active == active_frame_state_.crtc_active_state) {
-    /* Don't set the same state twice */
-    args.active.reset();
-  }
-
-  if (!args.HasInputs()) {
-    /* nothing to do */
-    return 0;
+auto DrmAtomicStateManager::EncodeFrame(AtomicCommitArgs &args, int *out_fence)
+    -> int {
+  ResetNewFrameState();
+  auto &new_frame_state = new_frame_state_;
+  auto &pset = request_;
+  pset->Reset();
+
+  if (args.display_mode || args.active) {
+    /* Encode the full state on modeset */
+    pset->InvalidateShadow();
   }
 
-  if (!active_frame_state_.crtc_active_state) {
-    /* Force activate display */
-    args.active = true;
-  }
-
-  auto new_frame_state = NewFrameState();
-
   auto *drm = pipe_->device;
   auto *connector = pipe_->connector->Get();
   auto *crtc = pipe_->crtc->Get();
 
-  auto pset = MakeDrmModeAtomicReqUnique();
-  if (!pset) {
-    ALOGE("Failed to allocate property set");
-    return -ENOMEM;
-  }
-
-  int out_fence = -1;
   if (!args.writeback_fb) {
     if (!crtc->GetOutFencePtrProperty().  //
-         AtomicSet(*pset, uint64_t(&out_fence))) {
+         AtomicSet(*pset, uint64_t(out_fence))) {
       return -EINVAL;
     }
   } else {
     if (!connector->GetWritebackOutFenceProperty().  //
-         AtomicSet(*pset, uint64_t(&out_fence))) {
+         AtomicSet(*pset, uint64_t(out_fence))) {
       return -EINVAL;
     }
 
@@ -101,10 +132,7 @@ auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
     }
   }
 
-  bool nonblock = true;
-
   if (args.active) {
-    nonblock = false;
     new_frame_state.crtc_active_state = *args.active;
     if (!crtc->GetActiveProperty().AtomicSet(*pset, *args.active ? 1 : 0) ||
         !connector->GetCrtcIdProperty().AtomicSet(*pset, crtc->GetId())) {
@@ -125,10 +153,17 @@ auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
     }
   }
 
+  if (args.vrr_enabled) {
+    new_frame_state.vrr_enabled = *args.vrr_enabled;
+    if (!crtc->GetVrrEnabledProperty().AtomicSet(*pset,
+                                                 *args.vrr_enabled ? 1 : 0)) {
+      return -EINVAL;
+    }
+  }
+
   if (args.color_matrix && crtc->GetCtmProperty()) {
-    auto blob = drm->RegisterUserPropertyBlob(args.color_matrix.get(),
-                                              sizeof(drm_color_ctm));
-    new_frame_state.ctm_blob = std::move(blob);
+    new_frame_state.ctm_blob = drm->GetPropertyBlobCache().GetOrCreateBlob(
+        args.color_matrix.get(), sizeof(drm_color_ctm));
 
     if (!new_frame_state.ctm_blob) {
       ALOGE("Failed to create CTM blob");
@@ -139,155 +174,968 @@ auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
       return -EINVAL;
   }
 
-  auto unused_planes = new_frame_state.used_planes;
-
   if (args.composition) {
+    new_frame_state.composition = args.composition->plan;
     new_frame_state.used_planes.clear();
 
+    auto &last_used = GetLastCommittedState().used_planes;
     for (auto &joining : args.composition->plan) {
       DrmPlane *plane = joining.plane->Get();
       LayerData &layer = joining.layer;
 
+      /* Plane could be re-configured by other pipelines meanwhile */
+      if (std::find(last_used.begin(), last_used.end(), joining.plane) ==
+          last_used.end()) {
+        pset->InvalidateShadow(plane->GetId());
+      }
+
       new_frame_state.used_framebuffers.emplace_back(layer.fb);
       new_frame_state.used_planes.emplace_back(joining.plane);
 
-      /* Remove from 'unused' list, since plane is re-used */
-      auto &v = unused_planes;
-      v.erase(std::remove(v.begin(), v.end(), joining.plane), v.end());
-
       if (plane->AtomicSetState(*pset, layer, joining.z_pos, crtc->GetId()) !=
           0) {
         return -EINVAL;
       }
     }
-  }
 
-  if (args.composition) {
-    for (auto &plane : unused_planes) {
+    /* Disable planes which were used by the prior frame but not re-used */
+    auto &used = new_frame_state.used_planes;
+    for (auto &plane : last_used) {
+      if (std::find(used.begin(), used.end(), plane) != used.end()) {
+        continue;
+      }
+
       if (plane->Get()->AtomicDisablePlane(*pset) != 0) {
         return -EINVAL;
       }
     }
   }
 
-  uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+  if (AttachesCapture(args)) {
+    if (!capture_connector_->GetCrtcIdProperty().AtomicSet(*pset,
+                                                          crtc->GetId())) {
+      return -EINVAL;
+    }
+    new_frame_state.capture_connector = capture_connector_;
+  }
 
-  if (args.test_only) {
-    return drmModeAtomicCommit(*drm->GetFd(), pset.get(),
-                               flags | DRM_MODE_ATOMIC_TEST_ONLY, drm);
+  if (args.capture_fb) {
+    auto *capture = new_frame_state.capture_connector;
+    if (capture == nullptr ||
+        !capture->GetWritebackFbIdProperty().  //
+         AtomicSet(*pset, args.capture_fb->GetFbId()) ||
+        !capture->GetWritebackOutFenceProperty().  //
+         AtomicSet(*pset, uint64_t(&capture_out_fence_))) {
+      return -EINVAL;
+    }
+
+    new_frame_state.used_framebuffers.emplace_back(args.capture_fb);
+  }
+
+  return 0;
+}
+
+static bool IsSameJoining(const DrmKmsPlan::LayerToPlaneJoining &a,
+                          const DrmKmsPlan::LayerToPlaneJoining &b) {
+  auto &la = a.layer;
+  auto &lb = b.layer;
+  if (a.plane != b.plane || a.z_pos != b.z_pos || la.fb != lb.fb ||
+      la.acquire_fence != lb.acquire_fence || !la.bi != !lb.bi) {
+    return false;
+  }
+
+  if (la.bi && (la.bi->blend_mode != lb.bi->blend_mode ||
+                la.bi->color_space != lb.bi->color_space ||
+                la.bi->sample_range != lb.bi->sample_range)) {
+    return false;
+  }
+
+  auto &pa = la.pi;
+  auto &pb = lb.pi;
+  return pa.transform == pb.transform && pa.alpha == pb.alpha &&
+         pa.source_crop.left == pb.source_crop.left &&
+         pa.source_crop.top == pb.source_crop.top &&
+         pa.source_crop.right == pb.source_crop.right &&
+         pa.source_crop.bottom == pb.source_crop.bottom &&
+         pa.display_frame.left == pb.display_frame.left &&
+         pa.display_frame.top == pb.display_frame.top &&
+         pa.display_frame.right == pb.display_frame.right &&
+         pa.display_frame.bottom == pb.display_frame.bottom;
+}
+
+/* Frame is a no-op if it only repeats the composition which is already
+ * committed, using the same framebuffers and the same (already consumed)
+ * acquire fences.
+ */
+auto DrmAtomicStateManager::IsNoOpFrame(const AtomicCommitArgs &args) const
+    -> bool {
+  if (!args.composition || args.display_mode || args.active ||
+      args.color_matrix || args.writeback_fb || args.vrr_enabled ||
+      args.capture_fb) {
+    return false;
+  }
+
+  auto &last = GetLastCommittedState();
+  auto &plan = args.composition->plan;
+  if (!last.crtc_active_state || plan.empty() ||
+      plan.size() != last.composition.size()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < plan.size(); i++) {
+    if (!IsSameJoining(plan[i], last.composition[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+auto DrmAtomicStateManager::CanReuseValidatedRequest(
+    const AtomicCommitArgs &args) const -> bool {
+  return args.reuse_validated && validated_composition_ != nullptr &&
+         args.composition.get() == validated_composition_ &&
+         validated_frames_tracked_ == frames_tracked_ && !args.display_mode &&
+         !args.active && !args.color_matrix && !args.writeback_fb &&
+         !args.vrr_enabled && !args.capture_fb;
+}
+
+auto DrmAtomicStateManager::PatchValidatedRequest(AtomicCommitArgs &args,
+                                                  int *out_fence) -> int {
+  /* libdrm keeps the last value when the same property is added twice, so
+   * updated values are simply appended to the request which passed the test.
+   * Rewinding drops the updates appended by the previous attempt.
+   */
+  auto &pset = request_;
+  pset->SetCursor(validated_pset_cursor_);
+
+  if (!pipe_->crtc->Get()->GetOutFencePtrProperty().  //
+       AtomicSet(*pset, uint64_t(out_fence))) {
+    return -EINVAL;
+  }
+
+  new_frame_state_.composition = args.composition->plan;
+
+  auto &used_framebuffers = new_frame_state_.used_framebuffers;
+  used_framebuffers.clear();
+
+  for (auto &joining : args.composition->plan) {
+    used_framebuffers.emplace_back(joining.layer.fb);
+
+    if (joining.plane->Get()->AtomicSetBuffer(*pset, joining.layer) != 0) {
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+auto DrmAtomicStateManager::PrepareFrame(AtomicCommitArgs &args) -> int {
+  if (args.active &&
+      *args.active == GetLastCommittedState().crtc_active_state) {
+    /* Don't set the same state twice */
+    args.active.reset();
+  }
+
+  if (args.vrr_enabled &&
+      *args.vrr_enabled == GetLastCommittedState().vrr_enabled) {
+    args.vrr_enabled.reset();
+  }
+
+  if (!args.HasInputs()) {
+    /* nothing to do */
+    return 0;
+  }
+
+  if (!GetLastCommittedState().crtc_active_state) {
+    /* Force activate display */
+    args.active = true;
   }
 
-  if (last_present_fence_) {
+  const bool reuse_validated = CanReuseValidatedRequest(args);
+
+  /* Any commit except the successful test invalidates the tested request */
+  validated_composition_ = nullptr;
+
+  if (IsNoOpFrame(args)) {
+    /* Picture on the screen won't change, save the display controller and
+     * memory bandwidth. Fence of the frame being displayed is returned. */
     // NOLINTNEXTLINE(misc-const-correctness)
-    ATRACE_NAME("WaitPriorFramePresented");
+    ATRACE_NAME("ElideNoOpFrame");
+    if (!args.test_only) {
+      args.out_fence = GetLastCommittedState().present_fence;
+    }
+    return 0;
+  }
 
-    constexpr int kTimeoutMs = 500;
-    const int err = sync_wait(*last_present_fence_, kTimeoutMs);
-    if (err != 0) {
-      ALOGE("sync_wait(fd=%i) returned: %i (errno: %i)", *last_present_fence_,
-            err, errno);
+  /* Property set is allocated once and rewound for every next frame */
+  if (!request_) {
+    request_ = DrmAtomicRequest::CreateInstance();
+    if (!request_) {
+      return -ENOMEM;
     }
+  }
 
-    CleanupPriorFrameResources();
+  out_fence_ = -1;
+  capture_out_fence_ = -1;
+  int err = 0;
+  if (reuse_validated) {
+    // NOLINTNEXTLINE(misc-const-correctness)
+    ATRACE_NAME("ReuseValidatedRequest");
+    err = PatchValidatedRequest(args, &out_fence_);
+  } else {
+    err = EncodeFrame(args, &out_fence_);
+  }
+
+  if (err != 0) {
+    return err;
+  }
+
+  if (!args.test_only && args.composition) {
+    SetAcquireFenceDeadlines(args);
+  }
+
+  return 1;
+}
+
+void DrmAtomicStateManager::SetAcquireFenceDeadlines(
+    const AtomicCommitArgs &args) {
+  int64_t vblank_ns = 0;
+  {
+    const std::unique_lock lock(mutex_);
+    vblank_ns = PredictVblankNs(ResourceManager::GetTimeMonotonicNs());
+  }
+
+  for (auto &joining : args.composition->plan) {
+    auto &fence = joining.layer.acquire_fence;
+    if (!fence) {
+      continue;
+    }
+
+    acquire_fence_stats_.total++;
+    if (sync_wait(*fence, 0) == 0) {
+      continue;
+    }
+
+    acquire_fence_stats_.late++;
+    if (vblank_ns == 0 || !fence_deadline_supported_) {
+      continue;
+    }
+
+    SyncSetDeadline deadline{.deadline_ns = uint64_t(vblank_ns)};
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg)
+    if (ioctl(*fence, kSyncIocSetDeadline, &deadline) != 0 &&
+        errno == ENOTTY) {
+      ALOGI("Fence deadlines aren't supported by the kernel");
+      fence_deadline_supported_ = false;
+    }
+  }
+}
+
+void DrmAtomicStateManager::FinishFrame(AtomicCommitArgs &args, bool nonblock) {
+  args.out_fence = MakeSharedFd(out_fence_);
+  out_fence_ = -1;
+  if (args.capture_fb) {
+    args.capture_fence = MakeSharedFd(capture_out_fence_);
+    capture_out_fence_ = -1;
+  }
+
+  auto &new_frame_state = new_frame_state_;
+  new_frame_state.present_fence = args.out_fence;
+  if (nonblock) {
+    const std::unique_lock lock(mutex_);
+    vrr_active_ = new_frame_state.vrr_enabled;
+    if (resman_->GetCommitMarginNs() != 0 && !vrr_active_) {
+      auto target_ns = PredictVblankNs(ResourceManager::GetTimeMonotonicNs() +
+                                       commit_latency_ns_);
+      if (GetFramesInFlight() > 0 && target_ns != 0) {
+        /* Queued behind the frames in flight */
+        auto &newest = GetLastCommittedState();
+        target_ns = std::max(target_ns,
+                             newest.target_vblank_ns + vsync_period_ns_);
+      }
+      new_frame_state.target_vblank_ns = target_ns;
+    }
+    std::swap(GetStagedFrameState(frames_staged_), new_frame_state);
+    frames_staged_++;
+  } else {
+    const std::unique_lock lock(mutex_);
+    vrr_active_ = new_frame_state.vrr_enabled;
+    std::swap(active_frame_state_, new_frame_state);
+  }
+
+  new_frame_state.Clear();
+}
+
+auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
+  // NOLINTNEXTLINE(misc-const-correctness)
+  ATRACE_CALL();
+
+  auto err = PrepareFrame(args);
+  if (err <= 0) {
+    return err;
   }
 
+  auto *drm = pipe_->device;
+  /* Activation is a modeset anyway */
+  uint32_t flags = args.seamless && !args.active
+                       ? 0
+                       : DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+  if (args.test_only) {
+    if (args.seamless && args.active) {
+      /* Activation is a modeset, the switch itself can't be tested */
+      return -EAGAIN;
+    }
+
+    err = request_->Commit(*drm->GetFd(), flags | DRM_MODE_ATOMIC_TEST_ONLY,
+                           drm);
+
+    /* Keep the request, PresentDisplay() is likely to commit it as-is */
+    if (err == 0 && !args.display_mode && !args.active && !args.color_matrix &&
+        !args.writeback_fb && !args.vrr_enabled && !args.capture_fb) {
+      validated_composition_ = args.composition.get();
+      validated_pset_cursor_ = request_->GetCursor();
+      validated_frames_tracked_ = frames_tracked_;
+    }
+
+    return err;
+  }
+
+  /* Activating the CRTC is a blocking operation */
+  const bool nonblock = !args.active;
+
   if (nonblock) {
-    flags |= DRM_MODE_ATOMIC_NONBLOCK;
+    /* Flip event retires the frame */
+    flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+  }
+
+  /* Blocking commit replaces the active state directly, so nothing can be
+   * left in flight. Otherwise keep up to queue_depth frames in flight. */
+  const int max_in_flight = nonblock ? GetPresentQueueDepth() - 1 : 0;
+  while (GetFramesInFlight() > max_in_flight) {
+    RetireOldestFrame();
   }
 
-  auto err = drmModeAtomicCommit(*drm->GetFd(), pset.get(), flags, drm);
+  for (;;) {
+    err = request_->Commit(*drm->GetFd(), flags, &drm->GetEventListener());
+
+    /* Kernel rejects a nonblocking commit while the prior one is pending */
+    if (err != -EBUSY || GetFramesInFlight() == 0) {
+      break;
+    }
+
+    // NOLINTNEXTLINE(misc-const-correctness)
+    ATRACE_NAME("RetryBusyCommit");
+    RetireOldestFrame();
+  }
 
   if (err != 0) {
     ALOGE("Failed to commit pset ret=%d\n", err);
     return err;
   }
 
-  args.out_fence = MakeSharedFd(out_fence);
+  FinishFrame(args, nonblock);
 
-  if (nonblock) {
-    {
-      const std::unique_lock lock(mutex_);
-      last_present_fence_ = args.out_fence;
-      staged_frame_state_ = std::move(new_frame_state);
-      frames_staged_++;
+  return 0;
+}
+
+/* Present fence is signaled together with the flip event. Frames could be
+ * retired by the committing thread meanwhile, so the frames are retired by the
+ * fences rather than by counting the events. */
+static bool IsFrameDisplayed(const SharedFd &present_fence) {
+  return !present_fence || sync_wait(*present_fence, 0) == 0;
+}
+
+void DrmAtomicStateManager::OnPageFlip(uint32_t sequence,
+                                       int64_t timestamp_ns) {
+  {
+    const std::unique_lock lock(mutex_);
+    if (exit_thread_)
+      return;
+
+    const uint32_t vblanks = sequence - last_flip_.sequence;
+    if (last_flip_.timestamp_ns != 0 && vblanks != 0 && !vrr_active_) {
+      vsync_period_ns_ = (timestamp_ns - last_flip_.timestamp_ns) / vblanks;
+    }
+
+    last_flip_ = {.sequence = sequence, .timestamp_ns = timestamp_ns};
+
+    /* Hand the buffers back without waiting for the commit in progress */
+    for (int frame_no = frames_tracked_; frame_no != frames_staged_;
+         frame_no++) {
+      auto &state = GetStagedFrameState(frame_no);
+      if (!IsFrameDisplayed(state.present_fence)) {
+        break;
+      }
+
+      SignalFrameTimelines(state);
+      UpdateCommitLatency(state, timestamp_ns);
+      retire_pending_ = true;
+    }
+  }
+
+  /* The listener thread serves all the CRTCs of the device, so it doesn't
+   * wait for commit_mutex_. Framebuffers are released by the commit thread,
+   * or by the next commit. */
+  if (present_timeline_ && !aggregator_) {
+    commit_cv_.notify_all();
+  }
+}
+
+void DrmAtomicStateManager::RetireDisplayedFrames() {
+  const std::unique_lock lock(mutex_);
+  retire_pending_ = false;
+  while (GetFramesInFlight() > 0 &&
+         IsFrameDisplayed(GetStagedFrameState(frames_tracked_).present_fence)) {
+    CleanupPriorFrameResources();
+  }
+}
+
+auto DrmAtomicStateManager::PredictVblankNs(int64_t time_ns) const
+    -> int64_t {
+  if (vsync_period_ns_ <= 0 || last_flip_.timestamp_ns == 0) {
+    return 0;
+  }
+
+  const int64_t since_flip_ns = time_ns - last_flip_.timestamp_ns;
+  if (since_flip_ns <= 0) {
+    return last_flip_.timestamp_ns;
+  }
+
+  const int64_t periods = (since_flip_ns + vsync_period_ns_ - 1) /
+                          vsync_period_ns_;
+  return last_flip_.timestamp_ns + periods * vsync_period_ns_;
+}
+
+void DrmAtomicStateManager::UpdateCommitLatency(KmsState &state,
+                                                int64_t flip_ns) {
+  if (state.target_vblank_ns == 0 || vsync_period_ns_ <= 0) {
+    return;
+  }
+
+  constexpr int64_t kMinCommitLatencyNs = 250000;
+  if (flip_ns > state.target_vblank_ns + vsync_period_ns_ / 2) {
+    /* Missed the vblank, commit earlier */
+    commit_latency_ns_ = std::min(commit_latency_ns_ * 2,
+                                  vsync_period_ns_ / 2);
+  } else {
+    constexpr int kDecayShift = 4;
+    commit_latency_ns_ = std::max(commit_latency_ns_ -
+                                      (commit_latency_ns_ >> kDecayShift),
+                                  kMinCommitLatencyNs);
+  }
+
+  /* Account every frame once */
+  state.target_vblank_ns = 0;
+}
+
+auto DrmAtomicStateManager::GetCommitDeadlineNs() -> int64_t {
+  const int64_t margin_ns = resman_->GetCommitMarginNs();
+  if (margin_ns == 0) {
+    return 0;
+  }
+
+  const std::unique_lock lock(mutex_);
+  if (frames_dequeued_ == frames_queued_ || vrr_active_) {
+    return 0;
+  }
+
+  const int64_t now_ns = ResourceManager::GetTimeMonotonicNs();
+  const int64_t lead_ns = commit_latency_ns_ + margin_ns;
+  const int64_t vblank_ns = PredictVblankNs(now_ns + lead_ns);
+  if (vblank_ns == 0) {
+    return 0;
+  }
+
+  return vblank_ns - lead_ns;
+}
+
+void DrmAtomicStateManager::WaitForCommitDeadline() {
+  const int64_t deadline_ns = GetCommitDeadlineNs();
+  if (deadline_ns == 0) {
+    return;
+  }
+
+  // NOLINTNEXTLINE(misc-const-correctness)
+  ATRACE_NAME("WaitCommitDeadline");
+  const auto deadline = std::chrono::steady_clock::time_point(
+      std::chrono::nanoseconds(deadline_ns));
+  std::unique_lock lk(mutex_);
+  commit_cv_.wait_until(lk, deadline, [this] { return exit_thread_; });
+}
+
+auto DrmAtomicStateManager::GetLastFlip() -> FlipInfo {
+  const std::unique_lock lock(mutex_);
+  return last_flip_;
+}
+
+void DrmAtomicStateManager::CleanupPriorFrameResources() {
+  assert(GetFramesInFlight() > 0);
+
+  // NOLINTNEXTLINE(misc-const-correctness)
+  ATRACE_NAME("CleanupPriorFrameResources");
+  auto &oldest = GetStagedFrameState(frames_tracked_);
+  SignalFrameTimelines(oldest);
+  std::swap(active_frame_state_, oldest);
+  oldest.Clear();
+  frames_tracked_++;
+}
+
+void DrmAtomicStateManager::RetireOldestFrame() {
+  /* Called with commit_mutex_ held, so the thread can't retire it meanwhile */
+  auto present_fence = GetStagedFrameState(frames_tracked_).present_fence;
+
+  if (present_fence) {
+    // NOLINTNEXTLINE(misc-const-correctness)
+    ATRACE_NAME("WaitPriorFramePresented");
+
+    constexpr int kTimeoutMs = 500;
+    const int err = sync_wait(*present_fence, kTimeoutMs);
+    if (err != 0) {
+      ALOGE("sync_wait(fd=%i) returned: %i (errno: %i)", *present_fence, err,
+            errno);
     }
-    cv_.notify_all();
+  }
+
+  const std::unique_lock lock(mutex_);
+  CleanupPriorFrameResources();
+}
+
+auto DrmAtomicStateManager::GetPresentQueueDepth() const -> int {
+  if (!present_timeline_) {
+    return 1;
+  }
+
+  return std::clamp(pipe_->device->GetResMan().GetPresentQueueDepth(), 1,
+                    kMaxQueueDepth);
+}
+
+auto DrmAtomicStateManager::IsAsyncCommitAllowed(
+    const AtomicCommitArgs &args) const -> bool {
+  /* Modeset and activation are kept synchronous, as well as writeback which
+   * has to return the fence of the writeback connector */
+  return present_timeline_ && !args.test_only && args.composition &&
+         !args.display_mode && !args.active && !args.writeback_fb &&
+         !args.capture_fb && active_frame_state_.crtc_active_state;
+}
+
+auto DrmAtomicStateManager::QueueFrame(AtomicCommitArgs &args,
+                                       uint32_t release_pt) -> int {
+  if (frames_queued_ - frames_dequeued_ == kMaxQueueDepth) {
+    /* Commit thread is behind, commit the oldest frame from here */
+    // NOLINTNEXTLINE(misc-const-correctness)
+    ATRACE_NAME("CommitQueueFull");
+    ProcessQueuedFrame();
+  }
+
+  const uint32_t timeline_pt = frames_queued_ + 1;
+  auto fence = present_timeline_->CreateFence(timeline_pt);
+  if (!fence) {
+    FlushQueuedFrames();
+    auto err = CommitFrameOrDisable(args);
+    AttachTimelinePoints(0, release_pt);
+    return err;
+  }
+
+  auto &frame = queued_frames_[frames_queued_ % kMaxQueueDepth];
+  if (!frame.composition) {
+    frame.composition = std::make_shared<DrmKmsPlan>();
+  }
+  frame.composition->plan = args.composition->plan;
+
+  if (validated_composition_ == args.composition.get()) {
+    validated_composition_ = frame.composition.get();
+  }
+
+  frame.args = args;
+  frame.args.composition = frame.composition;
+  frame.timeline_pt = timeline_pt;
+  frame.release_pt = release_pt;
+
+  args.out_fence = std::move(fence);
+
+  {
+    const std::unique_lock lock(mutex_);
+    frames_queued_++;
+  }
+
+  if (aggregator_) {
+    aggregator_->NotifyFrameQueued();
   } else {
-    active_frame_state_ = std::move(new_frame_state);
+    commit_cv_.notify_all();
   }
 
   return 0;
 }
 
-void DrmAtomicStateManager::ThreadFn(
-    const std::shared_ptr<DrmAtomicStateManager> &dasm) {
-  int tracking_at_the_moment = -1;
-  auto &main_mutex = pipe_->device->GetResMan().GetMainLock();
+void DrmAtomicStateManager::ProcessQueuedFrame() {
+  if (frames_dequeued_ == frames_queued_) {
+    return;
+  }
 
-  for (;;) {
-    SharedFd present_fence;
+  // NOLINTNEXTLINE(misc-const-correctness)
+  ATRACE_CALL();
+  auto &frame = queued_frames_[frames_dequeued_ % kMaxQueueDepth];
 
+  /* Present fence is already returned to the frontend, so the failed frame
+   * is only logged. Its timeline point is signaled anyway. */
+  CommitFrameOrDisable(frame.args);
+  PopQueuedFrame();
+}
+
+void DrmAtomicStateManager::PopQueuedFrame() {
+  auto &frame = queued_frames_[frames_dequeued_ % kMaxQueueDepth];
+  AttachTimelinePoints(frame.timeline_pt, frame.release_pt);
+
+  /* Drop the references, but keep the plan storage */
+  frame.composition->plan.clear();
+  frame.args = {};
+
+  const std::unique_lock lock(mutex_);
+  frames_dequeued_++;
+}
+
+auto DrmAtomicStateManager::HasQueuedFrames() -> bool {
+  const std::unique_lock lock(mutex_);
+  return frames_dequeued_ != frames_queued_;
+}
+
+auto DrmAtomicStateManager::GetPriorFrameFence() -> SharedFd {
+  const std::unique_lock lock(mutex_);
+  if (frames_dequeued_ == frames_queued_ ||
+      GetFramesInFlight() < GetPresentQueueDepth()) {
+    return {};
+  }
+
+  return GetStagedFrameState(frames_tracked_).present_fence;
+}
+
+auto DrmAtomicStateManager::PrepareQueuedFrame() -> bool {
+  if (frames_dequeued_ == frames_queued_) {
+    return false;
+  }
+
+  RetireDisplayedFrames();
+
+  if (!active_frame_state_.crtc_active_state) {
+    /* Activation is a blocking commit, it can't be merged */
+    ProcessQueuedFrame();
+    return false;
+  }
+
+  auto &frame = queued_frames_[frames_dequeued_ % kMaxQueueDepth];
+  auto err = PrepareFrame(frame.args);
+  if (err < 0) {
+    CompleteQueuedFrame(err);
+    return false;
+  }
+
+  if (err == 0) {
+    PopQueuedFrame();
+    return false;
+  }
+
+  while (GetFramesInFlight() > GetPresentQueueDepth() - 1) {
+    RetireOldestFrame();
+  }
+
+  return true;
+}
+
+void DrmAtomicStateManager::CompleteQueuedFrame(int commit_err) {
+  auto &frame = queued_frames_[frames_dequeued_ % kMaxQueueDepth];
+
+  if (request_) {
+    request_->ApplyCommitResult(DRM_MODE_ATOMIC_NONBLOCK, commit_err);
+  }
+
+  if (commit_err == 0) {
+    FinishFrame(frame.args, /*nonblock=*/true);
+  } else {
+    /* Retry without the other pipelines */
+    CommitFrameOrDisable(frame.args);
+  }
+
+  PopQueuedFrame();
+}
+
+void DrmAtomicStateManager::FlushQueuedFrames() {
+  while (frames_dequeued_ != frames_queued_) {
+    ProcessQueuedFrame();
+  }
+}
+
+void DrmAtomicStateManager::AttachTimelinePoints(uint32_t present_pt,
+                                                 uint32_t release_pt) {
+  const std::unique_lock lock(mutex_);
+  if (GetFramesInFlight() > 0) {
+    auto &newest = GetStagedFrameState(frames_staged_ - 1);
+    if (present_pt != 0) {
+      newest.present_timeline_pt = present_pt;
+    }
+    if (release_pt != 0) {
+      newest.release_fence_pt_index = release_pt;
+    }
+    return;
+  }
+
+  if (present_timeline_ && present_pt != 0) {
+    present_timeline_->SignalUpTo(present_pt);
+  }
+  if (release_timeline_ && release_pt != 0) {
+    release_timeline_->SignalUpTo(release_pt);
+  }
+}
+
+void DrmAtomicStateManager::SignalFrameTimelines(const KmsState &state) {
+  if (present_timeline_ && state.present_timeline_pt != 0) {
+    present_timeline_->SignalUpTo(state.present_timeline_pt);
+  }
+  if (release_timeline_ && state.release_fence_pt_index != 0) {
+    release_timeline_->SignalUpTo(state.release_fence_pt_index);
+  }
+}
+
+void DrmAtomicStateManager::CommitThreadFn(
+    const std::shared_ptr<DrmAtomicStateManager> & /*dasm*/) {
+  pipe_->device->GetResMan().ApplyCommitThreadScheduling();
+
+  for (;;) {
+    bool frame_queued = false;
     {
       std::unique_lock lk(mutex_);
-      cv_.wait(lk);
+      commit_cv_.wait(lk, [this] {
+        return exit_thread_ || frames_dequeued_ != frames_queued_ ||
+               retire_pending_;
+      });
 
-      if (exit_thread_ || dasm.use_count() == 1)
+      if (exit_thread_)
         break;
 
-      if (frames_staged_ <= tracking_at_the_moment)
-        continue;
-
-      tracking_at_the_moment = frames_staged_;
+      frame_queued = frames_dequeued_ != frames_queued_;
+    }
 
-      present_fence = last_present_fence_;
-      if (!present_fence)
-        continue;
+    if (!frame_queued) {
+      const std::unique_lock clk(commit_mutex_);
+      RetireDisplayedFrames();
+      continue;
     }
 
-    {
+    /* Wait for a free slot in the kernel queue without holding
+     * commit_mutex_, so the frontend isn't blocked meanwhile */
+    auto prior_fence = GetPriorFrameFence();
+
+    if (prior_fence) {
       // NOLINTNEXTLINE(misc-const-correctness)
-      ATRACE_NAME("AsyncWaitForBuffersSwap");
+      ATRACE_NAME("WaitPriorFramePresented");
       constexpr int kTimeoutMs = 500;
-      auto err = sync_wait(*present_fence, kTimeoutMs);
+      auto err = sync_wait(*prior_fence, kTimeoutMs);
       if (err != 0) {
-        ALOGE("sync_wait(fd=%i) returned: %i (errno: %i)", *present_fence, err,
+        ALOGE("sync_wait(fd=%i) returned: %i (errno: %i)", *prior_fence, err,
               errno);
       }
     }
 
+    WaitForCommitDeadline();
+
+    const std::unique_lock clk(commit_mutex_);
     {
-      const std::unique_lock mlk(main_mutex);
       const std::unique_lock lk(mutex_);
       if (exit_thread_)
         break;
-
-      /* If resources is already cleaned-up by main thread, skip */
-      if (tracking_at_the_moment > frames_tracked_)
-        CleanupPriorFrameResources();
     }
+
+    ProcessQueuedFrame();
+  }
+
+  /* Frames left in the queue won't be displayed, don't keep the frontend
+   * waiting for them */
+  {
+    const std::unique_lock lk(mutex_);
+    present_timeline_->SignalUpTo(frames_queued_);
   }
 
-  ALOGI("DrmAtomicStateManager thread exit");
+  ALOGI("DrmAtomicStateManager commit thread exit");
 }
 
-void DrmAtomicStateManager::CleanupPriorFrameResources() {
-  assert(frames_staged_ - frames_tracked_ == 1);
-  assert(last_present_fence_);
+void DrmAtomicStateManager::StopThread() {
+  if (aggregator_) {
+    aggregator_->RemoveMember(this);
+  }
 
-  // NOLINTNEXTLINE(misc-const-correctness)
-  ATRACE_NAME("CleanupPriorFrameResources");
-  frames_tracked_++;
-  active_frame_state_ = std::move(staged_frame_state_);
-  last_present_fence_ = {};
+  pipe_->device->GetEventListener().RegisterFlipHandler(
+      pipe_->crtc->Get()->GetId(), {});
+
+  {
+    const std::unique_lock lock(mutex_);
+    exit_thread_ = true;
+  }
+  commit_cv_.notify_all();
 }
 
 auto DrmAtomicStateManager::ExecuteAtomicCommit(AtomicCommitArgs &args) -> int {
+  const std::unique_lock lock(commit_mutex_);
+  RetireDisplayedFrames();
+
+  if (!args.test_only) {
+    /* Newer frame replaces it */
+    follow_up_args_.reset();
+  }
+
+  uint32_t release_pt = 0;
+  if (!args.test_only && release_timeline_) {
+    release_pt = ++release_points_;
+    args.release_fence = release_timeline_->CreateFence(release_pt);
+  }
+
+  if (IsAsyncCommitAllowed(args)) {
+    return QueueFrame(args, release_pt);
+  }
+
+  if (!args.test_only) {
+    /* Keep the commit order */
+    FlushQueuedFrames();
+  }
+
+  auto err = CommitFrameOrDisable(args);
+  AttachTimelinePoints(0, release_pt);
+  return err;
+}
+
+void DrmAtomicStateManager::SetCaptureConnector(DrmConnector *connector) {
+  const std::unique_lock lock(commit_mutex_);
+  capture_connector_ = connector;
+}
+
+auto DrmAtomicStateManager::IsCaptureAttached() -> bool {
+  const std::unique_lock lock(commit_mutex_);
+  return capture_connector_ != nullptr &&
+         GetLastCommittedState().capture_connector == capture_connector_;
+}
+
+auto DrmAtomicStateManager::CommitAfterFlip(AtomicCommitArgs &args) -> int {
+  const std::unique_lock lock(commit_mutex_);
+  RetireDisplayedFrames();
+  follow_up_args_.reset();
+
+  if (IsAsyncCommitAllowed(args)) {
+    /* Commit thread waits for the flip */
+    return QueueFrame(args, 0);
+  }
+
+  if (GetFramesInFlight() == 0 && !HasQueuedFrames()) {
+    return CommitFrameOrDisable(args);
+  }
+
+  /* Private copy, the frontend reuses its plan */
+  if (!follow_up_composition_) {
+    follow_up_composition_ = std::make_shared<DrmKmsPlan>();
+  }
+  follow_up_composition_->plan = args.composition->plan;
+  follow_up_args_ = args;
+  follow_up_args_->composition = follow_up_composition_;
+
+  ScheduleFollowUpFrame(++follow_up_seq_, GetNextFlipNs());
+  return 0;
+}
+
+auto DrmAtomicStateManager::GetNextFlipNs() -> int64_t {
+  const int64_t now_ns = ResourceManager::GetTimeMonotonicNs();
+  /* Present fence is signaled shortly after the flip */
+  constexpr int64_t kFlipSlackNs = 1000000;
+  constexpr int64_t kFallbackPeriodNs = 16666667;
+
+  const std::unique_lock lock(mutex_);
+  const int64_t vblank_ns = PredictVblankNs(now_ns);
+  if (vblank_ns == 0 || vrr_active_) {
+    return now_ns + kFallbackPeriodNs;
+  }
+
+  return vblank_ns + kFlipSlackNs;
+}
+
+void DrmAtomicStateManager::ScheduleFollowUpFrame(uint32_t seq,
+                                                  int64_t time_ns) {
+  resman_->GetTimerService()->Schedule(
+      time_ns, [weak_dasm = self_, seq](int64_t /*time_ns*/) {
+        auto dasm = weak_dasm.lock();
+        if (dasm) {
+          dasm->OnFollowUpTimer(seq);
+        }
+      });
+}
+
+void DrmAtomicStateManager::OnFollowUpTimer(uint32_t seq) {
+  /* Don't hold the shared timer thread behind a commit in progress */
+  const std::unique_lock lock(commit_mutex_, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    constexpr int64_t kRetryNs = 1000000;
+    ScheduleFollowUpFrame(seq, ResourceManager::GetTimeMonotonicNs() +
+                                   kRetryNs);
+    return;
+  }
+
+  if (seq != follow_up_seq_ || !follow_up_args_) {
+    return;
+  }
+
+  {
+    const std::unique_lock lk(mutex_);
+    if (exit_thread_) {
+      return;
+    }
+  }
+
+  RetireDisplayedFrames();
+  if (GetFramesInFlight() != 0 || HasQueuedFrames()) {
+    /* Flip is late, committing now would wait for it */
+    ScheduleFollowUpFrame(seq, GetNextFlipNs());
+    return;
+  }
+
+  auto args = std::move(*follow_up_args_);
+  follow_up_args_.reset();
+  CommitFrameOrDisable(args);
+}
+
+auto DrmAtomicStateManager::CommitFrameOrDisable(AtomicCommitArgs &args)
+    -> int {
   auto err = CommitFrame(args);
 
+  if (err != 0 && !args.test_only && args.capture_fb) {
+    /* Capture is optional, don't lose the frame because of it */
+    ALOGW("Failed to capture the frame of pipeline %s",
+          pipe_->connector->Get()->GetName().c_str());
+    args.capture_fb.reset();
+    err = CommitFrame(args);
+  }
+
+  if (err != 0 && !args.test_only && AttachesCapture(args)) {
+    /* The CRTC may not drive the writeback connector, keep the modeset */
+    ALOGW("Failed to attach the writeback connector to pipeline %s",
+          pipe_->connector->Get()->GetName().c_str());
+    capture_connector_ = nullptr;
+    err = CommitFrame(args);
+  }
+
   if (!args.test_only) {
     if (err != 0) {
       ALOGE("Composite failed for pipeline %s",
             pipe_->connector->Get()->GetName().c_str());
+      composition_failed_ = true;
+
+      if (!recovery_plan_) {
+        recovery_plan_ = std::make_shared<DrmKmsPlan>();
+      }
+
+      if ((BuildLastGoodPlan(args) && CommitRecoveryPlan(args)) ||
+          (BuildClientTargetPlan(args) && CommitRecoveryPlan(args))) {
+        ALOGW("Recovered pipeline %s using a fallback composition",
+              pipe_->connector->Get()->GetName().c_str());
+        return 0;
+      }
+
       // Disable the hw used by the last active composition. This allows us to
       // signal the release fences from that composition to avoid hanging.
       AtomicCommitArgs cl_args{};
@@ -301,7 +1149,86 @@ auto DrmAtomicStateManager::ExecuteAtomicCommit(AtomicCommitArgs &args) -> int {
   }
 
   return err;
-}  // namespace android
+}
+
+auto DrmAtomicStateManager::BuildLastGoodPlan(const AtomicCommitArgs &args)
+    -> bool {
+  auto &last = GetLastCommittedState().composition;
+  if (!args.composition || last.empty() ||
+      args.composition->plan.size() != last.size()) {
+    return false;
+  }
+
+  auto &plan = recovery_plan_->plan;
+  bool same_planes = true;
+  for (size_t i = 0; i < last.size(); i++) {
+    auto layer = args.composition->plan[i].layer;
+    if (!last[i].plane->Get()->IsValidForLayer(&layer)) {
+      plan.clear();
+      return false;
+    }
+
+    same_planes &= args.composition->plan[i].plane == last[i].plane &&
+                   args.composition->plan[i].z_pos == last[i].z_pos;
+    plan.emplace_back(DrmKmsPlan::LayerToPlaneJoining{
+        .layer = std::move(layer),
+        .plane = last[i].plane,
+        .z_pos = last[i].z_pos,
+    });
+  }
+
+  /* Same plane assignment has just failed */
+  if (same_planes) {
+    plan.clear();
+    return false;
+  }
+
+  return true;
+}
+
+auto DrmAtomicStateManager::BuildClientTargetPlan(const AtomicCommitArgs &args)
+    -> bool {
+  if (!args.client_target || !args.client_target->fb) {
+    return false;
+  }
+
+  auto layer = *args.client_target;
+  if (!pipe_->primary_plane->Get()->IsValidForLayer(&layer)) {
+    return false;
+  }
+
+  recovery_plan_->plan.emplace_back(DrmKmsPlan::LayerToPlaneJoining{
+      .layer = std::move(layer),
+      .plane = pipe_->primary_plane,
+      .z_pos = 0,
+  });
+
+  return true;
+}
+
+auto DrmAtomicStateManager::CommitRecoveryPlan(AtomicCommitArgs &args)
+    -> bool {
+  // NOLINTNEXTLINE(misc-const-correctness)
+  ATRACE_CALL();
+
+  auto fallback_args = args;
+  fallback_args.composition = recovery_plan_;
+  fallback_args.reuse_validated = false;
+
+  auto err = CommitFrame(fallback_args);
+  recovery_plan_->plan.clear();
+  if (err != 0) {
+    return false;
+  }
+
+  args.out_fence = std::move(fallback_args.out_fence);
+  return true;
+}
+
+auto DrmAtomicStateManager::ConsumeCompositionFailure() -> bool {
+  const std::unique_lock lock(commit_mutex_);
+  return std::exchange(composition_failed_, false);
+}
 
 auto DrmAtomicStateManager::ActivateDisplayUsingDPMS() -> int {
   return drmModeConnectorSetProperty(*pipe_->device->GetFd(),
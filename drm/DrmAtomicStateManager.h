@@ -18,14 +18,20 @@
 
 #include <pthread.h>
 
+#include <array>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <optional>
 
 #include "compositor/DrmKmsPlan.h"
 #include "compositor/LayerData.h"
+#include "drm/DrmAtomicRequest.h"
 #include "drm/DrmPlane.h"
+#include "drm/DrmPropertyBlobCache.h"
 #include "drm/ResourceManager.h"
 #include "drm/VSyncWorker.h"
+#include "utils/SwSyncTimeline.h"
 
 namespace android {
 
@@ -33,23 +39,49 @@ struct AtomicCommitArgs {
   /* inputs. All fields are optional, but at least one has to be specified */
   bool test_only = false;
   std::optional<DrmMode> display_mode;
+  /* Mode change is committed without ALLOW_MODESET, so the kernel rejects it
+   * unless the display timing can be switched without blanking */
+  bool seamless = false;
   std::optional<bool> active;
   std::shared_ptr<DrmKmsPlan> composition;
   std::shared_ptr<drm_color_ctm> color_matrix;
+  /* Variable refresh, dropped if already in this state */
+  std::optional<bool> vrr_enabled;
+
+  /* Commit the request which passed the last test_only commit of the same
+   * composition, refreshing only the framebuffers and the in-fences. Full
+   * request is encoded if the tested one can't be reused. */
+  bool reuse_validated = false;
 
   std::shared_ptr<DrmFbIdHandle> writeback_fb;
   SharedFd writeback_release_fence;
 
+  /* Writes the composed frame into |capture_fb| as well, using the capture
+   * connector. Fails unless IsCaptureAttached(). */
+  std::shared_ptr<DrmFbIdHandle> capture_fb;
+
+  /* Client target, displayed alone if the composition is rejected */
+  std::optional<LayerData> client_target;
+
   /* out */
   SharedFd out_fence;
+  /* Signaled once the framebuffers replaced by this frame are not scanned out
+   * anymore. Not set if sw_sync isn't available. */
+  SharedFd release_fence;
+  /* Signaled once |capture_fb| is written */
+  SharedFd capture_fence;
 
   /* helpers */
   auto HasInputs() const -> bool {
-    return display_mode || active || composition;
+    return display_mode || active || composition || vrr_enabled;
   }
 };
 
+class DrmCommitAggregator;
+
 class DrmAtomicStateManager {
+  friend class DrmCommitAggregator;
+
  public:
   static auto CreateInstance(DrmDisplayPipeline *pipe)
       -> std::shared_ptr<DrmAtomicStateManager>;
@@ -57,19 +89,70 @@ class DrmAtomicStateManager {
   ~DrmAtomicStateManager() = default;
 
   auto ExecuteAtomicCommit(AtomicCommitArgs &args) -> int;
+  /* Writeback connector to capture the frames with. Attaching it to the CRTC
+   * changes the connectors of the CRTC, so it is attached by the next modeset
+   * and the captures don't need one. nullptr stops the attaching. */
+  void SetCaptureConnector(DrmConnector *connector);
+  auto IsCaptureAttached() -> bool;
+  /* Commits |args| once the frame committed last is displayed, dropped if
+   * another frame is committed meanwhile. Doesn't wait for the flip. */
+  auto CommitAfterFlip(AtomicCommitArgs &args) -> int;
   auto ActivateDisplayUsingDPMS() -> int;
 
-  void StopThread() {
-    {
-      const std::unique_lock lock(mutex_);
-      exit_thread_ = true;
-    }
-    cv_.notify_all();
+  struct FlipInfo {
+    /* CRTC vblank counter and CLOCK_MONOTONIC time of the last flip */
+    uint32_t sequence{};
+    int64_t timestamp_ns{};
+  };
+
+  auto GetLastFlip() -> FlipInfo;
+
+  struct AcquireFenceStats {
+    uint32_t total{};
+    /* Not signaled yet at the commit time */
+    uint32_t late{};
+  };
+
+  auto GetAcquireFenceStats() {
+    const std::unique_lock lock(commit_mutex_);
+    return acquire_fence_stats_;
   }
 
+  /* Returns true once after the kernel rejected a composition, the frontend
+   * shouldn't offer the same composition for the next frame */
+  auto ConsumeCompositionFailure() -> bool;
+
+  void StopThread();
+
  private:
   DrmAtomicStateManager() = default;
   auto CommitFrame(AtomicCommitArgs &args) -> int;
+  /* Returns 1 if the request is ready to be committed, 0 if there is nothing
+   * to commit, or a negative error code */
+  auto PrepareFrame(AtomicCommitArgs &args) -> int;
+  /* Moves the committed frame into the staged or the active state */
+  void FinishFrame(AtomicCommitArgs &args, bool nonblock);
+  /* If the commit fails, retries with the last committed plan and the new
+   * buffers, then with the client target on the primary plane. Disables the
+   * planes if nothing works. */
+  auto CommitFrameOrDisable(AtomicCommitArgs &args) -> int;
+  /* Fill recovery_plan_, return false if the fallback isn't applicable */
+  auto BuildLastGoodPlan(const AtomicCommitArgs &args) -> bool;
+  auto BuildClientTargetPlan(const AtomicCommitArgs &args) -> bool;
+  auto CommitRecoveryPlan(AtomicCommitArgs &args) -> bool;
+  std::shared_ptr<DrmKmsPlan> recovery_plan_;
+  bool composition_failed_{};
+
+  /* Asks the producers of the pending acquire fences to finish by the
+   * predicted vblank, and accounts the late fences */
+  void SetAcquireFenceDeadlines(const AtomicCommitArgs &args);
+  AcquireFenceStats acquire_fence_stats_;
+  bool fence_deadline_supported_ = true;
+  auto EncodeFrame(AtomicCommitArgs &args, int *out_fence) -> int;
+
+  auto IsNoOpFrame(const AtomicCommitArgs &args) const -> bool;
+  auto CanReuseValidatedRequest(const AtomicCommitArgs &args) const -> bool;
+  auto PatchValidatedRequest(AtomicCommitArgs &args, int *out_fence) -> int;
 
   struct KmsState {
     /* Required to cleanup unused planes */
@@ -78,34 +161,198 @@ class DrmAtomicStateManager {
      * otherwise picture will blink */
     std::vector<std::shared_ptr<DrmFbIdHandle>> used_framebuffers;
 
-    DrmModeUserPropertyBlobUnique mode_blob;
-    DrmModeUserPropertyBlobUnique ctm_blob;
+    DrmModeUserPropertyBlobShared mode_blob;
+    DrmModeUserPropertyBlobShared ctm_blob;
+
+    /* Copy of the committed composition to detect no-op frames */
+    std::vector<DrmKmsPlan::LayerToPlaneJoining> composition;
+    SharedFd present_fence;
+
+    /* Timeline points to signal once this frame is displayed */
+    uint32_t release_fence_pt_index{};
+    uint32_t present_timeline_pt{};
+
+    /* Vblank the frame was committed for, 0 if not predicted */
+    int64_t target_vblank_ns{};
 
-    int release_fence_pt_index{};
+    /* Writeback connector attached to the CRTC */
+    DrmConnector *capture_connector{};
 
     /* To avoid setting the inactive state twice, which will fail the commit */
     bool crtc_active_state{};
+    bool vrr_enabled{};
+
+    /* Drops all the references, but keeps the vectors capacity */
+    void Clear() {
+      used_planes.clear();
+      used_framebuffers.clear();
+      mode_blob.reset();
+      ctm_blob.reset();
+      composition.clear();
+      present_fence.reset();
+      release_fence_pt_index = 0;
+      present_timeline_pt = 0;
+      target_vblank_ns = 0;
+    }
   } active_frame_state_;
 
-  auto NewFrameState() -> KmsState {
-    auto *prev_frame_state = &active_frame_state_;
-    return (KmsState){
-        .used_planes = prev_frame_state->used_planes,
-        .crtc_active_state = prev_frame_state->crtc_active_state,
-    };
+  /* Frame states are recycled instead of being re-created for every frame
+   * to avoid heap allocations in the steady state.
+   */
+  void ResetNewFrameState() {
+    /* New frame follows the frames in flight, not the one on the screen.
+     * Copy-assignment reuses the existing storage. */
+    auto &last = GetLastCommittedState();
+    new_frame_state_.used_planes = last.used_planes;
+    new_frame_state_.used_framebuffers.clear();
+    new_frame_state_.mode_blob.reset();
+    new_frame_state_.ctm_blob.reset();
+    new_frame_state_.composition = last.composition;
+    new_frame_state_.present_fence.reset();
+    new_frame_state_.capture_connector = last.capture_connector;
+    new_frame_state_.crtc_active_state = last.crtc_active_state;
+    new_frame_state_.vrr_enabled = last.vrr_enabled;
   }
 
+  KmsState new_frame_state_;
+  std::unique_ptr<DrmAtomicRequest> request_;
+  /* Written by the kernel on commit */
+  int out_fence_ = -1;
+  int capture_out_fence_ = -1;
+
+  /* Request which passed the last test_only commit */
+  DrmKmsPlan *validated_composition_{};
+  int validated_pset_cursor_{};
+  int validated_frames_tracked_{};
+
   DrmDisplayPipeline *pipe_{};
+  ResourceManager *resman_{};
 
   void CleanupPriorFrameResources();
+  /* Waits for the oldest in-flight frame to be presented and retires it */
+  void RetireOldestFrame();
+
+  /* Frames committed to the kernel but not retired yet. Frame #N is stored
+   * in the slot N % kMaxQueueDepth. */
+  static constexpr int kMaxQueueDepth = 3;
+  std::array<KmsState, kMaxQueueDepth> staged_frame_states_;
+
+  auto GetStagedFrameState(int frame_no) -> KmsState & {
+    return staged_frame_states_[frame_no % kMaxQueueDepth];
+  }
+
+  auto GetFramesInFlight() const {
+    return frames_staged_ - frames_tracked_;
+  }
+
+  /* The most recent state submitted to the kernel */
+  auto GetLastCommittedState() const -> const KmsState & {
+    if (GetFramesInFlight() == 0) {
+      return active_frame_state_;
+    }
+    return staged_frame_states_[(frames_staged_ - 1) % kMaxQueueDepth];
+  }
 
-  KmsState staged_frame_state_;
-  SharedFd last_present_fence_;
   int frames_staged_{};
   int frames_tracked_{};
 
-  void ThreadFn(const std::shared_ptr<DrmAtomicStateManager> &dasm);
-  std::condition_variable cv_;
+  /* Kernel accepts a single pending nonblocking commit per CRTC, so the
+   * next commit still waits for the prior flip. Deeper queue is used only
+   * with the commit thread, where that wait doesn't block PresentDisplay(). */
+  auto GetPresentQueueDepth() const -> int;
+
+  /* Asynchronous commit. Frames are committed by the dedicated thread, while
+   * the frontend receives a fence of the present timeline. Frames are taken
+   * from the queue with commit_mutex_ held, by the commit thread or by the
+   * frontend thread if it has to keep the commit order.
+   */
+  auto IsAsyncCommitAllowed(const AtomicCommitArgs &args) const -> bool;
+  auto QueueFrame(AtomicCommitArgs &args, uint32_t release_pt) -> int;
+  void ProcessQueuedFrame();
+  void PopQueuedFrame();
+  void FlushQueuedFrames();
+  auto HasQueuedFrames() -> bool;
+  /* Fence to wait for before the next frame can be committed */
+  auto GetPriorFrameFence() -> SharedFd;
+  /* Signals the timeline points once all the committed frames are displayed.
+   * Zero point is ignored. */
+  void AttachTimelinePoints(uint32_t present_pt, uint32_t release_pt);
+  void SignalFrameTimelines(const KmsState &state);
+
+  struct QueuedFrame {
+    AtomicCommitArgs args;
+    /* Private copy, the frontend reuses its plan for the next frame */
+    std::shared_ptr<DrmKmsPlan> composition;
+    uint32_t timeline_pt{};
+    uint32_t release_pt{};
+  };
+
+  std::array<QueuedFrame, kMaxQueueDepth> queued_frames_;
+  /* Written with both commit_mutex_ and mutex_ held */
+  uint32_t frames_queued_{};
+  uint32_t frames_dequeued_{};
+  std::unique_ptr<SwSyncTimeline> present_timeline_;
+
+  std::unique_ptr<SwSyncTimeline> release_timeline_;
+  uint32_t release_points_{};
+
+  void CommitThreadFn(const std::shared_ptr<DrmAtomicStateManager> &dasm);
+  std::condition_variable commit_cv_;
+
+  /* Multi-CRTC commit. Both are called with commit_mutex_ held. Prepared
+   * frame is encoded into request_, which is committed by the aggregator. */
+  auto PrepareQueuedFrame() -> bool;
+  void CompleteQueuedFrame(int commit_err);
+  std::shared_ptr<DrmCommitAggregator> aggregator_;
+
+  /* commit_mutex_ held */
+  DrmConnector *capture_connector_{};
+  auto AttachesCapture(const AtomicCommitArgs &args) const -> bool {
+    return capture_connector_ != nullptr &&
+           (args.active || (args.display_mode && !args.seamless));
+  }
+
+  /* Frame of CommitAfterFlip() committed from the TimerService thread. Only
+   * the callback scheduled for |follow_up_seq_| commits it. commit_mutex_
+   * held. */
+  std::optional<AtomicCommitArgs> follow_up_args_;
+  std::shared_ptr<DrmKmsPlan> follow_up_composition_;
+  uint32_t follow_up_seq_{};
+  void ScheduleFollowUpFrame(uint32_t seq, int64_t time_ns);
+  void OnFollowUpTimer(uint32_t seq);
+  /* Expected time of the next flip, mutex_ not held */
+  auto GetNextFlipNs() -> int64_t;
+  std::weak_ptr<DrmAtomicStateManager> self_;
+
+  /* Signals the timelines of the frames displayed by the flip, called by
+   * DrmEventListener. Doesn't take commit_mutex_. */
+  void OnPageFlip(uint32_t sequence, int64_t timestamp_ns);
+  /* Releases the resources of the displayed frames, commit_mutex_ held */
+  void RetireDisplayedFrames();
+  /* Displayed frames are waiting for RetireDisplayedFrames(), mutex_ held */
+  bool retire_pending_{};
+  FlipInfo last_flip_;
+
+  /* Just-in-time commit. Vblanks are predicted from the flip events, commit
+   * latency estimate grows when a frame misses its vblank and slowly decays
+   * otherwise. Guarded by mutex_. */
+  auto PredictVblankNs(int64_t time_ns) const -> int64_t;
+  /* Time to commit the oldest queued frame at, 0 to commit immediately */
+  auto GetCommitDeadlineNs() -> int64_t;
+  /* Waits until the deadline of the oldest queued frame or exit */
+  void WaitForCommitDeadline();
+  void UpdateCommitLatency(KmsState &state, int64_t flip_ns);
+  int64_t vsync_period_ns_{};
+  static constexpr int64_t kInitialCommitLatencyNs = 1000000;
+  int64_t commit_latency_ns_ = kInitialCommitLatencyNs;
+  /* Refresh follows the commits, nothing to schedule against */
+  bool vrr_active_{};
+
+  /* Serializes the commits and the retirement of the frames between the
+   * frontend, the commit thread and the aggregator, so the pipelines don't
+   * wait for each other. Taken before mutex_. */
+  std::mutex commit_mutex_;
+
   std::mutex mutex_;
   bool exit_thread_{};
 };
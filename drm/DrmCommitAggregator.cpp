@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-drm-commit-aggregator"
+
+#include "DrmCommitAggregator.h"
+
+#include <drm/drm_mode.h>
+#include <sync/sync.h>
+#include <utils/Trace.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "drm/DrmAtomicStateManager.h"
+#include "drm/DrmDevice.h"
+#include "drm/DrmEventListener.h"
+#include "drm/ResourceManager.h"
+#include "utils/log.h"
+
+namespace android {
+
+auto DrmCommitAggregator::CreateInstance(DrmDevice *drm)
+    -> std::shared_ptr<DrmCommitAggregator> {
+  auto aggregator = std::shared_ptr<DrmCommitAggregator>(
+      new DrmCommitAggregator());
+
+  aggregator->drm_ = drm;
+  aggregator->pset_ = MakeDrmModeAtomicReqUnique();
+  if (!aggregator->pset_) {
+    ALOGE("Failed to allocate property set");
+    return {};
+  }
+
+  std::thread(&DrmCommitAggregator::ThreadFn, aggregator.get(), aggregator)
+      .detach();
+
+  return aggregator;
+}
+
+void DrmCommitAggregator::AddMember(DrmAtomicStateManager *dasm) {
+  const std::unique_lock lock(mutex_);
+  members_.emplace_back(Member{.dasm = dasm, .in_last_round = false});
+}
+
+void DrmCommitAggregator::RemoveMember(DrmAtomicStateManager *dasm) {
+  const std::unique_lock rlk(round_mutex_);
+  const std::unique_lock lock(mutex_);
+  members_.erase(std::remove_if(members_.begin(), members_.end(),
+                                [dasm](auto &m) { return m.dasm == dasm; }),
+                 members_.end());
+}
+
+void DrmCommitAggregator::NotifyFrameQueued() {
+  {
+    /* Avoid missing the wake-up between the predicate check and the wait */
+    const std::unique_lock lock(mutex_);
+  }
+  cv_.notify_all();
+}
+
+auto DrmCommitAggregator::IsAnyFrameQueued() const -> bool {
+  return std::any_of(members_.begin(), members_.end(),
+                     [](auto &m) { return m.dasm->HasQueuedFrames(); });
+}
+
+auto DrmCommitAggregator::IsRoundComplete() const -> bool {
+  return std::all_of(members_.begin(), members_.end(), [](auto &m) {
+    return !m.in_last_round || m.dasm->HasQueuedFrames();
+  });
+}
+
+void DrmCommitAggregator::WaitForRoundDeadline() {
+  std::unique_lock lk(mutex_);
+  int64_t deadline_ns = 0;
+  for (auto &member : members_) {
+    const int64_t member_deadline_ns = member.dasm->GetCommitDeadlineNs();
+    if (member_deadline_ns != 0 &&
+        (deadline_ns == 0 || member_deadline_ns < deadline_ns)) {
+      deadline_ns = member_deadline_ns;
+    }
+  }
+
+  if (deadline_ns == 0) {
+    return;
+  }
+
+  // NOLINTNEXTLINE(misc-const-correctness)
+  ATRACE_NAME("WaitCommitDeadline");
+  const auto deadline = std::chrono::steady_clock::time_point(
+      std::chrono::nanoseconds(deadline_ns));
+  cv_.wait_until(lk, deadline, [this] { return exit_thread_; });
+}
+
+void DrmCommitAggregator::CommitRound() {
+  // NOLINTNEXTLINE(misc-const-correctness)
+  ATRACE_CALL();
+
+  drmModeAtomicSetCursor(pset_.get(), 0);
+  prepared_.clear();
+
+  for (auto *dasm : round_) {
+    if (!dasm->PrepareQueuedFrame()) {
+      continue;
+    }
+
+    if (dasm->request_->AppendTo(pset_.get()) < 0) {
+      dasm->CompleteQueuedFrame(-ENOMEM);
+      continue;
+    }
+
+    prepared_.emplace_back(dasm);
+  }
+
+  if (prepared_.empty()) {
+    return;
+  }
+
+  const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET |
+                         DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+  int err = 0;
+  for (;;) {
+    err = drmModeAtomicCommit(*drm_->GetFd(), pset_.get(), flags,
+                              &drm_->GetEventListener());
+
+    /* Some of the CRTCs still have a pending commit */
+    if (err != -EBUSY) {
+      break;
+    }
+
+    bool retired = false;
+    for (auto *dasm : prepared_) {
+      if (dasm->GetFramesInFlight() > 0) {
+        dasm->RetireOldestFrame();
+        retired = true;
+      }
+    }
+
+    if (!retired) {
+      break;
+    }
+  }
+
+  if (err != 0) {
+    ALOGE("Failed to commit %zu pipelines together ret=%d", prepared_.size(),
+          err);
+  }
+
+  for (auto *dasm : prepared_) {
+    dasm->CompleteQueuedFrame(err);
+  }
+}
+
+void DrmCommitAggregator::ThreadFn(
+    const std::shared_ptr<DrmCommitAggregator> & /*aggregator*/) {
+  drm_->GetResMan().ApplyCommitThreadScheduling();
+
+  /* Frontend presents the displays one after another, the frames which
+   * belong to the same refresh are expected within this window */
+  constexpr auto kCollectWindow = std::chrono::milliseconds(2);
+
+  for (;;) {
+    {
+      std::unique_lock lk(mutex_);
+      cv_.wait(lk, [this] { return exit_thread_ || IsAnyFrameQueued(); });
+
+      if (exit_thread_)
+        break;
+
+      cv_.wait_for(lk, kCollectWindow,
+                   [this] { return exit_thread_ || IsRoundComplete(); });
+
+      if (exit_thread_)
+        break;
+
+      for (auto &member : members_) {
+        auto fence = member.dasm->GetPriorFrameFence();
+        if (fence) {
+          prior_fences_.emplace_back(std::move(fence));
+        }
+      }
+    }
+
+    /* Wait for the free slots in the kernel queues without holding the
+     * commit locks, so the frontends aren't blocked meanwhile */
+    for (auto &fence : prior_fences_) {
+      // NOLINTNEXTLINE(misc-const-correctness)
+      ATRACE_NAME("WaitPriorFramePresented");
+      constexpr int kTimeoutMs = 500;
+      auto err = sync_wait(*fence, kTimeoutMs);
+      if (err != 0) {
+        ALOGE("sync_wait(fd=%i) returned: %i (errno: %i)", *fence, err, errno);
+      }
+    }
+    prior_fences_.clear();
+
+    WaitForRoundDeadline();
+
+    const std::unique_lock rlk(round_mutex_);
+    {
+      const std::unique_lock lk(mutex_);
+      if (exit_thread_)
+        break;
+
+      /* Members can't be removed meanwhile, since the round lock is held */
+      round_.clear();
+      for (auto &member : members_) {
+        member.in_last_round = member.dasm->HasQueuedFrames();
+        if (member.in_last_round) {
+          round_.emplace_back(member.dasm);
+        }
+      }
+    }
+
+    /* Frontends hold a single commit lock at a time, so taking several of
+     * them in any order can't deadlock */
+    for (auto *dasm : round_) {
+      round_locks_.emplace_back(dasm->commit_mutex_);
+    }
+
+    CommitRound();
+    round_locks_.clear();
+  }
+
+  ALOGI("DrmCommitAggregator thread exit");
+}
+
+}  // namespace android
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "drm/DrmUnique.h"
+#include "utils/fd.h"
+
+namespace android {
+
+class DrmAtomicStateManager;
+class DrmDevice;
+
+/* Commits the frames queued by all the pipelines of the DRM device using a
+ * single atomic request. Each CRTC still gets its own OUT_FENCE_PTR, so the
+ * present fences stay per display. Pipelines which can't be committed
+ * together are committed separately.
+ */
+class DrmCommitAggregator {
+ public:
+  static auto CreateInstance(DrmDevice *drm)
+      -> std::shared_ptr<DrmCommitAggregator>;
+
+  void AddMember(DrmAtomicStateManager *dasm);
+  /* Waits for the round in progress, which may commit the member */
+  void RemoveMember(DrmAtomicStateManager *dasm);
+
+  void NotifyFrameQueued();
+
+  void StopThread() {
+    {
+      const std::unique_lock lock(mutex_);
+      exit_thread_ = true;
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  DrmCommitAggregator() = default;
+
+  auto IsAnyFrameQueued() const -> bool;
+  /* All the members committed by the last round have the next frame */
+  auto IsRoundComplete() const -> bool;
+
+  /* Holds the round until the earliest commit deadline of the members */
+  void WaitForRoundDeadline();
+
+  void CommitRound();
+
+  void ThreadFn(const std::shared_ptr<DrmCommitAggregator> &aggregator);
+
+  struct Member {
+    DrmAtomicStateManager *dasm;
+    bool in_last_round;
+  };
+
+  std::vector<Member> members_;
+
+  /* Held for the whole round, together with the commit locks of the round
+   * members. Taken before mutex_. */
+  std::mutex round_mutex_;
+  std::vector<std::unique_lock<std::mutex>> round_locks_;
+
+  /* Per-round scratch storage */
+  std::vector<DrmAtomicStateManager *> round_;
+  std::vector<DrmAtomicStateManager *> prepared_;
+  std::vector<SharedFd> prior_fences_;
+  DrmModeAtomicReqUnique pset_;
+
+  DrmDevice *drm_{};
+
+  std::condition_variable cv_;
+  std::mutex mutex_;
+  bool exit_thread_{};
+};
+
+}  // namespace android
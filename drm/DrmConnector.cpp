@@ -100,6 +100,15 @@ int DrmConnector::UpdateEdidProperty() {
              : -EINVAL;
 }
 
+auto DrmConnector::IsVrrCapable() -> bool {
+  if (!GetOptionalConnectorProperty(*drm_, *this, "vrr_capable",
+                                    &vrr_capable_property_)) {
+    return false;
+  }
+
+  return vrr_capable_property_.GetValue().value_or(0) != 0;
+}
+
 auto DrmConnector::GetEdidBlob() -> DrmModePropertyBlobUnique {
   auto ret = UpdateEdidProperty();
   if (ret != 0) {
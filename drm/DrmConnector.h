@@ -42,6 +42,9 @@ class DrmConnector : public PipelineBindable<DrmConnector> {
   int UpdateEdidProperty();
   auto GetEdidBlob() -> DrmModePropertyBlobUnique;
 
+  /* Re-read on every call, the value follows the connected sink */
+  auto IsVrrCapable() -> bool;
+
   auto GetDev() const -> DrmDevice & {
     return *drm_;
   }
@@ -130,6 +133,7 @@ class DrmConnector : public PipelineBindable<DrmConnector> {
   DrmProperty dpms_property_;
   DrmProperty crtc_id_property_;
   DrmProperty edid_property_;
+  DrmProperty vrr_capable_property_;
   DrmProperty writeback_pixel_formats_;
   DrmProperty writeback_fb_id_;
   DrmProperty writeback_out_fence_;
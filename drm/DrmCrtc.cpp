@@ -66,6 +66,11 @@ auto DrmCrtc::CreateInstance(DrmDevice &dev, uint32_t crtc_id, uint32_t index)
     ALOGV("Missing optional CTM property");
   }
 
+  ret = GetCrtcProperty(dev, *c, "VRR_ENABLED", &c->vrr_enabled_property_);
+  if (ret != 0) {
+    ALOGV("Missing optional VRR_ENABLED property");
+  }
+
   return c;
 }
 
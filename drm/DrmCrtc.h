@@ -62,6 +62,10 @@ class DrmCrtc : public PipelineBindable<DrmCrtc> {
     return ctm_property_;
   }
 
+  auto &GetVrrEnabledProperty() const {
+    return vrr_enabled_property_;
+  }
+
  private:
   DrmCrtc(DrmModeCrtcUnique crtc, uint32_t index)
       : crtc_(std::move(crtc)), index_in_res_array_(index){};
@@ -71,6 +75,7 @@ class DrmCrtc : public PipelineBindable<DrmCrtc> {
   const uint32_t index_in_res_array_;
 
   DrmProperty ctm_property_;
+  DrmProperty vrr_enabled_property_;
 
   DrmProperty active_property_;
   DrmProperty mode_property_;
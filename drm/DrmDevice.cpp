@@ -26,7 +26,10 @@
 #include <string>
 
 #include "drm/DrmAtomicStateManager.h"
+#include "drm/DrmCommitAggregator.h"
+#include "drm/DrmEventListener.h"
 #include "drm/DrmPlane.h"
+#include "drm/DrmPropertyBlobCache.h"
 #include "drm/ResourceManager.h"
 #include "utils/log.h"
 #include "utils/properties.h"
@@ -51,6 +54,25 @@ auto DrmDevice::CreateInstance(std::string const &path,
 
 DrmDevice::DrmDevice(ResourceManager *res_man) : res_man_(res_man) {
   drm_fb_importer_ = std::make_unique<DrmFbImporter>(*this);
+  blob_cache_ = std::make_unique<DrmPropertyBlobCache>(*this);
+}
+
+DrmDevice::~DrmDevice() {
+  if (commit_aggregator_) {
+    commit_aggregator_->StopThread();
+  }
+
+  if (event_listener_) {
+    event_listener_->StopThread();
+  }
+}
+
+auto DrmDevice::GetCommitAggregator() -> std::shared_ptr<DrmCommitAggregator> {
+  if (!commit_aggregator_) {
+    commit_aggregator_ = DrmCommitAggregator::CreateInstance(this);
+  }
+
+  return commit_aggregator_;
 }
 
 auto DrmDevice::Init(const char *path) -> int {
@@ -94,6 +116,12 @@ auto DrmDevice::Init(const char *path) -> int {
     return -EACCES;
   }
 
+  event_listener_ = DrmEventListener::CreateInstance(fd_);
+  if (!event_listener_) {
+    ALOGE("Failed to create the DRM event listener");
+    return -ENOMEM;
+  }
+
   auto res = MakeDrmModeResUnique(*GetFd());
   if (!res) {
     ALOGE("Failed to get DrmDevice resources");
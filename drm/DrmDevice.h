@@ -27,13 +27,16 @@
 
 namespace android {
 
+class DrmCommitAggregator;
+class DrmEventListener;
 class DrmFbImporter;
+class DrmPropertyBlobCache;
 class DrmPlane;
 class ResourceManager;
 
 class DrmDevice {
  public:
-  ~DrmDevice() = default;
+  ~DrmDevice();
 
   static auto CreateInstance(std::string const &path, ResourceManager *res_man)
       -> std::unique_ptr<DrmDevice>;
@@ -74,6 +77,17 @@ class DrmDevice {
     return *drm_fb_importer_;
   }
 
+  auto &GetPropertyBlobCache() {
+    return *blob_cache_;
+  }
+
+  auto &GetEventListener() {
+    return *event_listener_;
+  }
+
+  /* Created on first use, called with the topology lock held */
+  auto GetCommitAggregator() -> std::shared_ptr<DrmCommitAggregator>;
+
   auto FindCrtcById(uint32_t id) const -> DrmCrtc * {
     for (const auto &crtc : crtcs_) {
       if (crtc->GetId() == id) {
@@ -117,6 +131,9 @@ class DrmDevice {
   bool HasAddFb2ModifiersSupport_{};
 
   std::unique_ptr<DrmFbImporter> drm_fb_importer_;
+  std::unique_ptr<DrmPropertyBlobCache> blob_cache_;
+  std::shared_ptr<DrmCommitAggregator> commit_aggregator_;
+  std::shared_ptr<DrmEventListener> event_listener_;
 
   ResourceManager *const res_man_;
 };
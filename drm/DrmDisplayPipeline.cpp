@@ -33,6 +33,7 @@ template <class O>
 auto PipelineBindable<O>::BindPipeline(DrmDisplayPipeline *pipeline,
                                        bool return_object_if_bound)
     -> std::shared_ptr<BindingOwner<O>> {
+  const std::unique_lock lock(bind_mutex_);
   auto owner_object = owner_object_.lock();
   if (owner_object) {
     if (bound_pipeline_ == pipeline && return_object_if_bound) {
@@ -166,9 +167,9 @@ static bool ReadUseOverlayProperty() {
   return strtol(use_overlay_planes_prop, nullptr, kStrtolBase) != 0;
 }
 
-auto DrmDisplayPipeline::GetUsablePlanes()
-    -> std::vector<std::shared_ptr<BindingOwner<DrmPlane>>> {
-  std::vector<std::shared_ptr<BindingOwner<DrmPlane>>> planes;
+void DrmDisplayPipeline::GetUsablePlanes(
+    std::vector<std::shared_ptr<BindingOwner<DrmPlane>>> &planes) {
+  planes.clear();
   planes.emplace_back(primary_plane);
 
   const static bool kUseOverlayPlanes = ReadUseOverlayProperty();
@@ -185,8 +186,6 @@ auto DrmDisplayPipeline::GetUsablePlanes()
       }
     }
   }
-
-  return planes;
 }
 
 DrmDisplayPipeline::~DrmDisplayPipeline() {
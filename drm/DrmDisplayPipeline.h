@@ -17,6 +17,7 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
 #include <vector>
 
 namespace android {
@@ -39,6 +40,7 @@ class PipelineBindable {
 
  public:
   auto *GetPipeline() {
+    const std::unique_lock lock(bind_mutex_);
     return bound_pipeline_;
   }
 
@@ -47,7 +49,9 @@ class PipelineBindable {
       -> std::shared_ptr<BindingOwner<O>>;
 
  private:
-  DrmDisplayPipeline *bound_pipeline_;
+  /* Shared planes are bound and released by the pipelines concurrently */
+  std::mutex bind_mutex_;
+  DrmDisplayPipeline *bound_pipeline_{};
   std::weak_ptr<BindingOwner<O>> owner_object_;
 };
 
@@ -56,7 +60,11 @@ class BindingOwner {
  public:
   explicit BindingOwner(B *pb) : bindable_(pb){};
   ~BindingOwner() {
-    bindable_->bound_pipeline_ = nullptr;
+    const std::unique_lock lock(bindable_->bind_mutex_);
+    /* Object could be bound again before the lock is taken */
+    if (bindable_->owner_object_.expired()) {
+      bindable_->bound_pipeline_ = nullptr;
+    }
   }
 
   B *Get() {
@@ -71,8 +79,9 @@ struct DrmDisplayPipeline {
   static auto CreatePipeline(DrmConnector &connector)
       -> std::unique_ptr<DrmDisplayPipeline>;
 
-  auto GetUsablePlanes()
-      -> std::vector<std::shared_ptr<BindingOwner<DrmPlane>>>;
+  /* Reuses the storage provided by the caller */
+  void GetUsablePlanes(
+      std::vector<std::shared_ptr<BindingOwner<DrmPlane>>> &planes);
 
   ~DrmDisplayPipeline();
 
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-event-listener"
+
+#include "DrmEventListener.h"
+
+#include <drm/drm_mode.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <xf86drm.h>
+
+#include <array>
+#include <cerrno>
+#include <thread>
+
+#include "utils/log.h"
+
+namespace android {
+
+auto DrmEventListener::CreateInstance(SharedFd drm_fd)
+    -> std::shared_ptr<DrmEventListener> {
+  auto listener = std::shared_ptr<DrmEventListener>(new DrmEventListener());
+
+  listener->drm_fd_ = std::move(drm_fd);
+  listener->epoll_fd_ = MakeUniqueFd(epoll_create1(EPOLL_CLOEXEC));
+  listener->exit_fd_ = MakeUniqueFd(eventfd(0, EFD_CLOEXEC));
+  if (!listener->drm_fd_ || !listener->epoll_fd_ || !listener->exit_fd_) {
+    ALOGE("Failed to create the event loop, errno: %i", errno);
+    return {};
+  }
+
+  for (const int fd : {*listener->drm_fd_, *listener->exit_fd_}) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(*listener->epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      ALOGE("Failed to add fd %i to epoll, errno: %i", fd, errno);
+      return {};
+    }
+  }
+
+  std::thread(&DrmEventListener::ThreadFn, listener.get(), listener).detach();
+
+  return listener;
+}
+
+void DrmEventListener::RegisterFlipHandler(uint32_t crtc_id,
+                                           FlipHandler handler) {
+  const std::unique_lock lock(mutex_);
+  if (handler) {
+    flip_handlers_[crtc_id] = std::move(handler);
+  } else {
+    flip_handlers_.erase(crtc_id);
+  }
+}
+
+void DrmEventListener::RegisterVblankHandler(uint32_t crtc_id,
+                                             VblankHandler handler) {
+  const std::unique_lock lock(mutex_);
+  auto &slot = vblank_slots_[crtc_id];
+  if (!slot) {
+    slot = std::make_unique<VblankSlot>();
+    slot->listener = this;
+  }
+  slot->handler = std::move(handler);
+}
+
+auto DrmEventListener::QueueVblankEvent(uint32_t crtc_id) -> int {
+  uint64_t user_data = 0;
+  {
+    const std::unique_lock lock(mutex_);
+    auto it = vblank_slots_.find(crtc_id);
+    if (it == vblank_slots_.end() || !it->second->handler) {
+      return -EINVAL;
+    }
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    user_data = reinterpret_cast<uint64_t>(it->second.get());
+  }
+
+  auto ret = drmCrtcQueueSequence(*drm_fd_, crtc_id,
+                                  DRM_CRTC_SEQUENCE_RELATIVE |
+                                      DRM_CRTC_SEQUENCE_NEXT_ON_MISS,
+                                  1, nullptr, user_data);
+  if (ret != 0) {
+    return -errno;
+  }
+
+  return 0;
+}
+
+void DrmEventListener::StopThread() {
+  const uint64_t value = 1;
+  if (write(*exit_fd_, &value, sizeof(value)) != sizeof(value)) {
+    ALOGE("Failed to stop the event loop, errno: %i", errno);
+  }
+}
+
+void DrmEventListener::PageFlipHandler(int /*fd*/, unsigned int sequence,
+                                       unsigned int tv_sec,
+                                       unsigned int tv_usec,
+                                       unsigned int crtc_id, void *user_data) {
+  if (user_data == nullptr) {
+    return;
+  }
+
+  constexpr int64_t kNsInSec = 1000000000LL;
+  constexpr int64_t kNsInUs = 1000LL;
+  auto timestamp_ns = int64_t(tv_sec) * kNsInSec + int64_t(tv_usec) * kNsInUs;
+
+  static_cast<DrmEventListener *>(user_data)->OnPageFlip(crtc_id, sequence,
+                                                         timestamp_ns);
+}
+
+void DrmEventListener::OnPageFlip(uint32_t crtc_id, uint32_t sequence,
+                                  int64_t timestamp_ns) {
+  FlipHandler handler;
+  {
+    const std::unique_lock lock(mutex_);
+    auto it = flip_handlers_.find(crtc_id);
+    if (it == flip_handlers_.end()) {
+      return;
+    }
+    handler = it->second;
+  }
+
+  handler(sequence, timestamp_ns);
+}
+
+void DrmEventListener::SequenceHandler(int /*fd*/, uint64_t sequence,
+                                       uint64_t ns, uint64_t user_data) {
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  auto *slot = reinterpret_cast<VblankSlot *>(user_data);
+  if (slot == nullptr) {
+    return;
+  }
+
+  slot->listener->OnVblank(slot, sequence, int64_t(ns));
+}
+
+void DrmEventListener::OnVblank(VblankSlot *slot, uint64_t sequence,
+                                int64_t timestamp_ns) {
+  VblankHandler handler;
+  {
+    const std::unique_lock lock(mutex_);
+    handler = slot->handler;
+  }
+
+  if (handler) {
+    handler(sequence, timestamp_ns);
+  }
+}
+
+void DrmEventListener::ThreadFn(
+    const std::shared_ptr<DrmEventListener> & /*listener*/) {
+  drmEventContext ctx{};
+  /* Version 4 introduced sequence_handler for the CRTC sequence events */
+  constexpr int kSequenceHandlerVersion = 4;
+  ctx.version = kSequenceHandlerVersion;
+  ctx.page_flip_handler2 = &DrmEventListener::PageFlipHandler;
+  ctx.sequence_handler = &DrmEventListener::SequenceHandler;
+
+  for (;;) {
+    std::array<epoll_event, 2> events{};
+    auto count = epoll_wait(*epoll_fd_, events.data(), int(events.size()), -1);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+
+      ALOGE("epoll_wait failed, errno: %i", errno);
+      break;
+    }
+
+    bool exit = false;
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.fd == *exit_fd_) {
+        exit = true;
+      } else {
+        drmHandleEvent(*drm_fd_, &ctx);
+      }
+    }
+
+    if (exit)
+      break;
+  }
+
+  ALOGI("DrmEventListener thread exit");
+}
+
+}  // namespace android
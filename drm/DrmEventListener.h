@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "utils/fd.h"
+
+namespace android {
+
+/* Reads the events of the DRM device fd and dispatches them per CRTC.
+ * Commits requesting the events must pass the listener as the user data.
+ */
+class DrmEventListener {
+ public:
+  using FlipHandler =
+      std::function<void(uint32_t /*sequence*/, int64_t /*timestamp_ns*/)>;
+  using VblankHandler =
+      std::function<void(uint64_t /*sequence*/, int64_t /*timestamp_ns*/)>;
+
+  static auto CreateInstance(SharedFd drm_fd)
+      -> std::shared_ptr<DrmEventListener>;
+
+  /* Empty handler unregisters. Handlers are called from the listener thread
+   * without any lock held. */
+  void RegisterFlipHandler(uint32_t crtc_id, FlipHandler handler);
+  void RegisterVblankHandler(uint32_t crtc_id, VblankHandler handler);
+
+  /* Requests a single event for the next vblank of the CRTC. Fails if the
+   * CRTC is off or the kernel has no CRTC sequence events. */
+  auto QueueVblankEvent(uint32_t crtc_id) -> int;
+
+  void StopThread();
+
+ private:
+  DrmEventListener() = default;
+
+  void ThreadFn(const std::shared_ptr<DrmEventListener> &listener);
+
+  static void PageFlipHandler(int fd, unsigned int sequence,
+                              unsigned int tv_sec, unsigned int tv_usec,
+                              unsigned int crtc_id, void *user_data);
+  void OnPageFlip(uint32_t crtc_id, uint32_t sequence, int64_t timestamp_ns);
+
+  struct VblankSlot {
+    DrmEventListener *listener;
+    VblankHandler handler;
+  };
+
+  static void SequenceHandler(int fd, uint64_t sequence, uint64_t ns,
+                              uint64_t user_data);
+  void OnVblank(VblankSlot *slot, uint64_t sequence, int64_t timestamp_ns);
+
+  SharedFd drm_fd_;
+  UniqueFd epoll_fd_ = MakeUniqueFd(-1);
+  /* Wakes up the thread on exit */
+  UniqueFd exit_fd_ = MakeUniqueFd(-1);
+
+  std::mutex mutex_;
+  std::map<uint32_t, FlipHandler> flip_handlers_;
+  /* Slot address is the user data of the queued events, so the slots are
+   * kept until the listener is destroyed */
+  std::map<uint32_t, std::unique_ptr<VblankSlot>> vblank_slots_;
+};
+
+}  // namespace android
@@ -92,6 +92,42 @@ auto DrmFbIdHandle::CreateInstance(BufferInfo *bo, GemHandle first_gem_handle,
   return local;
 }
 
+auto DrmFbIdHandle::CreateDumbInstance(DrmDevice &drm, uint32_t width,
+                                       uint32_t height, uint32_t format)
+    -> std::shared_ptr<DrmFbIdHandle> {
+  // NOLINTNEXTLINE(misc-const-correctness)
+  ATRACE_NAME("Create dumb buffer and register FB");
+
+  // NOLINTNEXTLINE(cppcoreguidelines-owning-memory): priv. constructor usage
+  std::shared_ptr<DrmFbIdHandle> local(new DrmFbIdHandle(drm));
+
+  constexpr uint32_t kBpp = 32;
+  struct drm_mode_create_dumb create {};
+  create.width = width;
+  create.height = height;
+  create.bpp = kBpp;
+  auto err = drmIoctl(*drm.GetFd(), DRM_IOCTL_MODE_CREATE_DUMB, &create);
+  if (err != 0) {
+    ALOGE("Failed to create %ux%u dumb buffer errno=%d", width, height, errno);
+    return {};
+  }
+
+  /* Closed by the destructor */
+  local->gem_handles_[0] = create.handle;
+
+  std::array<uint32_t, kBufferMaxPlanes> pitches{create.pitch};
+  std::array<uint32_t, kBufferMaxPlanes> offsets{};
+  err = drmModeAddFB2(*drm.GetFd(), width, height, format,
+                      local->gem_handles_.data(), pitches.data(),
+                      offsets.data(), &local->fb_id_, 0);
+  if (err != 0) {
+    ALOGE("could not create drm fb %d", err);
+    local.reset();
+  }
+
+  return local;
+}
+
 DrmFbIdHandle::~DrmFbIdHandle() {
   // NOLINTNEXTLINE(misc-const-correctness)
   ATRACE_NAME("Close FB and dmabufs");
@@ -101,6 +137,8 @@ DrmFbIdHandle::~DrmFbIdHandle() {
     ALOGE("Failed to rm fb");
   }
 
+  const std::unique_lock lock(drm_->GetDrmFbImporter().GetLock());
+
   /* Close GEM handles.
    *
    * WARNING: TODO(nobody):
@@ -127,6 +165,8 @@ DrmFbIdHandle::~DrmFbIdHandle() {
 
 auto DrmFbImporter::GetOrCreateFbId(BufferInfo *bo)
     -> std::shared_ptr<DrmFbIdHandle> {
+  const std::unique_lock lock(mutex_);
+
   /* Lookup DrmFbIdHandle in cache first. First handle serves as a cache key. */
   GemHandle first_handle = 0;
   auto err = drmPrimeFDToHandle(*drm_->GetFd(), bo->prime_fds[0],
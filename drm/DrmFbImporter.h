@@ -21,6 +21,7 @@
 
 #include <array>
 #include <map>
+#include <mutex>
 
 #include "bufferinfo/BufferInfo.h"
 #include "drm/DrmDevice.h"
@@ -38,6 +39,12 @@ class DrmFbIdHandle {
   static auto CreateInstance(BufferInfo *bo, GemHandle first_gem_handle,
                              DrmDevice &drm) -> std::shared_ptr<DrmFbIdHandle>;
 
+  /* Allocates a linear dumb buffer owned by the handle, for the formats
+   * using 32 bits per pixel */
+  static auto CreateDumbInstance(DrmDevice &drm, uint32_t width,
+                                 uint32_t height, uint32_t format)
+      -> std::shared_ptr<DrmFbIdHandle>;
+
   ~DrmFbIdHandle();
   DrmFbIdHandle(DrmFbIdHandle &&) = delete;
   DrmFbIdHandle(const DrmFbIdHandle &) = delete;
@@ -68,6 +75,13 @@ class DrmFbImporter {
 
   auto GetOrCreateFbId(BufferInfo *bo) -> std::shared_ptr<DrmFbIdHandle>;
 
+  /* Displays import the buffers concurrently. GEM handle of a buffer is the
+   * same for all the imports, so closing the handle is serialized with the
+   * imports as well. Recursive, as a failed import closes its handles. */
+  auto &GetLock() {
+    return mutex_;
+  }
+
  private:
   void CleanupEmptyCacheElements() {
     for (auto it = drm_fb_id_handle_cache_.begin();
@@ -82,6 +96,7 @@ class DrmFbImporter {
 
   DrmDevice *const drm_;
 
+  std::recursive_mutex mutex_;
   std::map<GemHandle, std::weak_ptr<DrmFbIdHandle>> drm_fb_id_handle_cache_;
 };
 
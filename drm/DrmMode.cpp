@@ -28,16 +28,16 @@ bool DrmMode::operator==(const drmModeModeInfo &m) const {
   return memcmp(&m, &mode_, offsetof(drmModeModeInfo, name)) == 0;
 }
 
-auto DrmMode::CreateModeBlob(const DrmDevice &drm)
-    -> DrmModeUserPropertyBlobUnique {
+auto DrmMode::CreateModeBlob(DrmDevice &drm)
+    -> DrmModeUserPropertyBlobShared {
   struct drm_mode_modeinfo drm_mode = {};
   /* drm_mode_modeinfo and drmModeModeInfo should be identical
    * At least libdrm does the same memcpy in drmModeAttachMode();
    */
   memcpy(&drm_mode, &mode_, sizeof(struct drm_mode_modeinfo));
 
-  return drm.RegisterUserPropertyBlob(&drm_mode,
-                                      sizeof(struct drm_mode_modeinfo));
+  return drm.GetPropertyBlobCache().GetOrCreateBlob(
+      &drm_mode, sizeof(struct drm_mode_modeinfo));
 }
 
 }  // namespace android
@@ -22,6 +22,7 @@
 #include <cstdio>
 #include <string>
 
+#include "DrmPropertyBlobCache.h"
 #include "DrmUnique.h"
 
 namespace android {
@@ -52,7 +53,7 @@ class DrmMode {
     return std::string(mode_.name) + "@" + std::to_string(GetVRefresh());
   }
 
-  auto CreateModeBlob(const DrmDevice &drm) -> DrmModeUserPropertyBlobUnique;
+  auto CreateModeBlob(DrmDevice &drm) -> DrmModeUserPropertyBlobShared;
 
  private:
   drmModeModeInfo mode_;
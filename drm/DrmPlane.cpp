@@ -248,7 +248,7 @@ static int To1616FixPt(float in) {
   return int(in * (1 << kBitShift));
 }
 
-auto DrmPlane::AtomicSetState(drmModeAtomicReq &pset, LayerData &layer,
+auto DrmPlane::AtomicSetState(DrmAtomicRequest &pset, LayerData &layer,
                               uint32_t zpos, uint32_t crtc_id) -> int {
   if (!layer.fb || !layer.bi) {
     ALOGE("%s: Invalid arguments", __func__);
@@ -316,7 +316,25 @@ auto DrmPlane::AtomicSetState(drmModeAtomicReq &pset, LayerData &layer,
   return 0;
 }
 
-auto DrmPlane::AtomicDisablePlane(drmModeAtomicReq &pset) -> int {
+auto DrmPlane::AtomicSetBuffer(DrmAtomicRequest &pset, LayerData &layer)
+    -> int {
+  if (!layer.fb) {
+    ALOGE("%s: Invalid arguments", __func__);
+    return -EINVAL;
+  }
+
+  /* -1 overrides the fence which may be left in the request */
+  const int in_fence = layer.acquire_fence ? *layer.acquire_fence : -1;
+
+  if (!in_fence_fd_property_.AtomicSet(pset, uint64_t(in_fence)) ||
+      !fb_property_.AtomicSet(pset, layer.fb->GetFbId())) {
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+auto DrmPlane::AtomicDisablePlane(DrmAtomicRequest &pset) -> int {
   if (!crtc_property_.AtomicSet(pset, 0) || !fb_property_.AtomicSet(pset, 0)) {
     return -EINVAL;
   }
@@ -48,9 +48,11 @@ class DrmPlane : public PipelineBindable<DrmPlane> {
   bool IsFormatSupported(uint32_t format) const;
   bool HasNonRgbFormat() const;
 
-  auto AtomicSetState(drmModeAtomicReq &pset, LayerData &layer, uint32_t zpos,
+  auto AtomicSetState(DrmAtomicRequest &pset, LayerData &layer, uint32_t zpos,
                       uint32_t crtc_id) -> int;
-  auto AtomicDisablePlane(drmModeAtomicReq &pset) -> int;
+  /* Sets only FB_ID and IN_FENCE_FD, other properties are left untouched */
+  auto AtomicSetBuffer(DrmAtomicRequest &pset, LayerData &layer) -> int;
+  auto AtomicDisablePlane(DrmAtomicRequest &pset) -> int;
   auto &GetZPosProperty() const {
     return zpos_property_;
   }
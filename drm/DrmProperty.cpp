@@ -25,11 +25,17 @@
 #include <cstdint>
 #include <string>
 
+#include "DrmAtomicRequest.h"
 #include "DrmDevice.h"
 #include "utils/log.h"
 
 namespace android {
 
+static bool IsOneShotProperty(const std::string &name) {
+  return name == "IN_FENCE_FD" || name == "OUT_FENCE_PTR" ||
+         name == "WRITEBACK_FB_ID" || name == "WRITEBACK_OUT_FENCE_PTR";
+}
+
 DrmProperty::DrmPropertyEnum::DrmPropertyEnum(drm_mode_property_enum *e)
     : value(e->value), name(e->name) {
 }
@@ -45,6 +51,7 @@ void DrmProperty::Init(uint32_t obj_id, drmModePropertyPtr p, uint64_t value) {
   flags_ = p->flags;
   name_ = p->name;
   value_ = value;
+  one_shot_ = IsOneShotProperty(name_);
 
   for (int i = 0; i < p->count_values; ++i)
     // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic):
@@ -111,13 +118,13 @@ std::tuple<uint64_t, int> DrmProperty::GetEnumValueWithName(
   return std::make_tuple(UINT64_MAX, -EINVAL);
 }
 
-auto DrmProperty::AtomicSet(drmModeAtomicReq &pset, uint64_t value) const
+auto DrmProperty::AtomicSet(DrmAtomicRequest &pset, uint64_t value) const
     -> bool {
   if (id_ == 0) {
     ALOGE("AtomicSet() is called on non-initialized property!");
     return false;
   }
-  if (drmModeAtomicAddProperty(&pset, obj_id_, id_, value) < 0) {
+  if (pset.Add(obj_id_, id_, value, one_shot_) < 0) {
     ALOGE("Failed to add obj_id: %u, prop_id: %u (%s) to pset", obj_id_, id_,
           name_.c_str());
     return false;
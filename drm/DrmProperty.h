@@ -26,6 +26,8 @@
 
 namespace android {
 
+class DrmAtomicRequest;
+
 class DrmProperty {
  public:
   DrmProperty() = default;
@@ -57,7 +59,13 @@ class DrmProperty {
   auto RangeMin() const -> std::tuple<int, uint64_t>;
   auto RangeMax() const -> std::tuple<int, uint64_t>;
 
-  [[nodiscard]] auto AtomicSet(drmModeAtomicReq &pset, uint64_t value) const
+  /* Values of such properties are consumed by the commit, and are not a part
+   * of the persistent KMS state */
+  bool IsOneShot() const {
+    return one_shot_;
+  }
+
+  [[nodiscard]] auto AtomicSet(DrmAtomicRequest &pset, uint64_t value) const
       -> bool;
 
   template <class E>
@@ -82,6 +90,7 @@ class DrmProperty {
   uint32_t id_ = 0;
 
   uint32_t flags_ = 0;
+  bool one_shot_{};
   std::string name_;
   uint64_t value_ = 0;
 
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-property-blob-cache"
+
+#include "DrmPropertyBlobCache.h"
+
+#include <cstring>
+#include <functional>
+#include <string_view>
+
+#include "drm/DrmDevice.h"
+#include "utils/log.h"
+
+namespace android {
+
+auto DrmPropertyBlobCache::GetOrCreateBlob(const void *data, size_t length)
+    -> DrmModeUserPropertyBlobShared {
+  const auto hash = std::hash<std::string_view>{}(
+      std::string_view(static_cast<const char *>(data), length));
+
+  const std::unique_lock lock(mutex_);
+
+  auto [first, last] = cache_.equal_range(hash);
+  for (auto it = first; it != last;) {
+    auto &entry = it->second;
+    if (entry.data.size() != length ||
+        memcmp(entry.data.data(), data, length) != 0) {
+      ++it;
+      continue;
+    }
+
+    if (auto blob = entry.blob.lock()) {
+      return blob;
+    }
+    it = cache_.erase(it);
+  }
+
+  /* Cleanup cached empty weak pointers */
+  const int minimal_cleanup_size = 32;
+  if (cache_.size() > minimal_cleanup_size) {
+    CleanupEmptyCacheElements();
+  }
+
+  /* Blob destruction doesn't touch the cache, expired entries are dropped
+   * on lookup instead */
+  CacheEntry entry;
+  entry.data.assign(static_cast<const uint8_t *>(data),
+                    static_cast<const uint8_t *>(data) + length);
+
+  DrmModeUserPropertyBlobShared blob = drm_->RegisterUserPropertyBlob(
+      entry.data.data(), length);
+  if (!blob) {
+    return {};
+  }
+
+  entry.blob = blob;
+  cache_.emplace(hash, std::move(entry));
+
+  return blob;
+}
+
+void DrmPropertyBlobCache::CleanupEmptyCacheElements() {
+  for (auto it = cache_.begin(); it != cache_.end();) {
+    if (it->second.blob.expired()) {
+      it = cache_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+}  // namespace android
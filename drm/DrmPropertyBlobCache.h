@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace android {
+
+class DrmDevice;
+
+/* Shared blob id, the blob is destroyed with the last reference */
+using DrmModeUserPropertyBlobShared = std::shared_ptr<const uint32_t>;
+
+/* Property blobs are looked up by their content, so identical modes, CTMs
+ * and LUTs are shared instead of being re-created for every frame.
+ */
+class DrmPropertyBlobCache {
+ public:
+  explicit DrmPropertyBlobCache(DrmDevice &drm) : drm_(&drm){};
+  ~DrmPropertyBlobCache() = default;
+  DrmPropertyBlobCache(const DrmPropertyBlobCache &) = delete;
+  DrmPropertyBlobCache(DrmPropertyBlobCache &&) = delete;
+  auto operator=(const DrmPropertyBlobCache &) = delete;
+  auto operator=(DrmPropertyBlobCache &&) = delete;
+
+  auto GetOrCreateBlob(const void *data, size_t length)
+      -> DrmModeUserPropertyBlobShared;
+
+ private:
+  void CleanupEmptyCacheElements();
+
+  struct CacheEntry {
+    /* Compared on lookup to resolve the hash collisions */
+    std::vector<uint8_t> data;
+    std::weak_ptr<const uint32_t> blob;
+  };
+
+  DrmDevice *const drm_;
+
+  std::mutex mutex_;
+  std::multimap<size_t /*hash*/, CacheEntry> cache_;
+};
+
+}  // namespace android
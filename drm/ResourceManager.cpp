@@ -18,8 +18,12 @@
 
 #include "ResourceManager.h"
 
+#include <pthread.h>
+#include <sched.h>
 #include <sys/stat.h>
 
+#include <cerrno>
+#include <cinttypes>
 #include <ctime>
 #include <sstream>
 
@@ -37,6 +41,14 @@ ResourceManager::ResourceManager(
     PipelineToFrontendBindingInterface *p2f_bind_interface)
     : frontend_interface_(p2f_bind_interface) {
   uevent_listener_ = UEventListener::CreateInstance();
+  timer_service_ = TimerService::CreateInstance();
+}
+
+ResourceManager::~ResourceManager() {
+  /* The service thread holds a reference, release it with the fds */
+  if (timer_service_) {
+    timer_service_->StopThread();
+  }
 }
 
 void ResourceManager::Init() {
@@ -88,13 +100,43 @@ void ResourceManager::Init() {
     ctm_handling_ = CtmHandling::kDrmOrGpu;
   }
 
+  property_get("vendor.hwc.drm.present_queue_depth", proptext, "1");
+  constexpr int kStrtolBase = 10;
+  present_queue_depth_ = int(strtol(proptext, nullptr, kStrtolBase));
+
+  property_get("vendor.hwc.drm.async_commit", proptext, "0");
+  async_commit_ = bool(strtol(proptext, nullptr, kStrtolBase));
+
+  property_get("vendor.hwc.drm.multi_crtc_commit", proptext, "0");
+  multi_crtc_commit_ = bool(strtol(proptext, nullptr, kStrtolBase));
+
+  property_get("vendor.hwc.drm.commit_thread_rt_priority", proptext, "0");
+  commit_thread_rt_priority_ = int(strtol(proptext, nullptr, kStrtolBase));
+
+  /* Hexadecimal CPU mask, e.g. "0xc" for CPUs 2 and 3. 0 disables pinning */
+  property_get("vendor.hwc.drm.commit_thread_cpu_mask", proptext, "0");
+  commit_thread_cpu_mask_ = strtoull(proptext, nullptr, 0);
+
+  property_get("vendor.hwc.drm.commit_margin_us", proptext, "0");
+  constexpr int64_t kNsInUs = 1000;
+  commit_margin_ns_ = strtoll(proptext, nullptr, kStrtolBase) * kNsInUs;
+
+  property_get("vendor.hwc.drm.vrr", proptext, "0");
+  vrr_enabled_ = bool(strtol(proptext, nullptr, kStrtolBase));
+
+  property_get("vendor.hwc.drm.idle_refresh", proptext, "0");
+  idle_refresh_ = bool(strtol(proptext, nullptr, kStrtolBase));
+
+  property_get("vendor.hwc.drm.writeback_flattening", proptext, "0");
+  writeback_flattening_ = bool(strtol(proptext, nullptr, kStrtolBase));
+
   if (BufferInfoGetter::GetInstance() == nullptr) {
     ALOGE("Failed to initialize BufferInfoGetter");
     return;
   }
 
   uevent_listener_->RegisterHotplugHandler([this] {
-    const std::unique_lock lock(GetMainLock());
+    const std::unique_lock lock(GetTopologyLock());
     UpdateFrontendDisplays();
   });
 
@@ -117,6 +159,34 @@ void ResourceManager::DeInit() {
   initialized_ = false;
 }
 
+void ResourceManager::ApplyCommitThreadScheduling() const {
+  if (commit_thread_rt_priority_ > 0) {
+    sched_param param{};
+    param.sched_priority = commit_thread_rt_priority_;
+    auto err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+      ALOGW("Failed to set SCHED_FIFO priority %d, err: %d",
+            commit_thread_rt_priority_, err);
+    }
+  }
+
+  if (commit_thread_cpu_mask_ != 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    constexpr int kMaskBits = 64;
+    for (int cpu = 0; cpu < kMaskBits; cpu++) {
+      if (((commit_thread_cpu_mask_ >> cpu) & 1U) != 0) {
+        CPU_SET(cpu, &cpus);
+      }
+    }
+
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+      ALOGW("Failed to set CPU affinity 0x%" PRIx64 ", errno: %d",
+            commit_thread_cpu_mask_, errno);
+    }
+  }
+}
+
 auto ResourceManager::GetTimeMonotonicNs() -> int64_t {
   struct timespec ts {};
   clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -124,6 +194,14 @@ auto ResourceManager::GetTimeMonotonicNs() -> int64_t {
   return int64_t(ts.tv_sec) * kNsInSec + int64_t(ts.tv_nsec);
 }
 
+auto ResourceManager::GetVsyncOffsetNs() -> int64_t {
+  char proptext[PROPERTY_VALUE_MAX];
+  property_get("vendor.hwc.drm.vsync_offset_us", proptext, "0");
+  constexpr int kStrtolBase = 10;
+  constexpr int64_t kNsInUs = 1000;
+  return strtoll(proptext, nullptr, kStrtolBase) * kNsInUs;
+}
+
 void ResourceManager::UpdateFrontendDisplays() {
   auto ordered_connectors = GetOrderedConnectors();
 
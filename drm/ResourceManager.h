@@ -23,6 +23,7 @@
 #include "DrmDisplayPipeline.h"
 #include "DrmFbImporter.h"
 #include "UEventListener.h"
+#include "utils/TimerService.h"
 
 namespace android {
 
@@ -47,7 +48,7 @@ class ResourceManager {
   ResourceManager &operator=(const ResourceManager &) = delete;
   ResourceManager(const ResourceManager &&) = delete;
   ResourceManager &&operator=(const ResourceManager &&) = delete;
-  ~ResourceManager() = default;
+  ~ResourceManager();
 
   void Init();
 
@@ -61,8 +62,61 @@ class ResourceManager {
     return ctm_handling_;
   }
 
-  auto &GetMainLock() {
-    return main_lock_;
+  /* Number of frames which can be queued to the kernel at the same time,
+   * 1 means that present waits for the prior frame to be displayed. Takes
+   * effect only with the asynchronous commit, see IsAsyncCommitEnabled(). */
+  auto GetPresentQueueDepth() const {
+    return present_queue_depth_;
+  }
+
+  /* Commit the frames from a dedicated per-CRTC thread, PresentDisplay()
+   * returns a fence which is signaled once the frame is displayed */
+  auto IsAsyncCommitEnabled() const {
+    return async_commit_;
+  }
+
+  /* Frames of all the pipelines of the DRM device are committed together by
+   * a single atomic request. Requires async commit. */
+  auto IsMultiCrtcCommitEnabled() const {
+    return async_commit_ && multi_crtc_commit_;
+  }
+
+  /* Queued frames are committed this long before the predicted vblank rather
+   * than immediately, 0 disables the scheduling */
+  auto GetCommitMarginNs() const {
+    return commit_margin_ns_;
+  }
+
+  /* Variable refresh is enabled on the capable displays */
+  auto IsVrrEnabled() const {
+    return vrr_enabled_;
+  }
+
+  /* Idle displays are switched to the lowest refresh rate of the mode */
+  auto IsIdleRefreshEnabled() const {
+    return idle_refresh_;
+  }
+
+  /* Idle displays are flattened by the writeback connector instead of the
+   * client */
+  auto IsWritebackFlatteningEnabled() const {
+    return writeback_flattening_;
+  }
+
+  /* Sets the configured priority and CPU affinity of the calling thread */
+  void ApplyCommitThreadScheduling() const;
+
+  /* Guards the set of the displays: hotplug, creation and removal of the
+   * displays and the device-wide HWC2 calls. State of every display is
+   * guarded by its own lock. Recursive, since the client calls the HAL back
+   * from the hotplug callback. */
+  auto &GetTopologyLock() {
+    return topology_lock_;
+  }
+
+  /* Shared by all the synthetic vsync sources */
+  auto GetTimerService() {
+    return timer_service_;
   }
 
   auto GetVirtualDisplayPipeline() -> std::shared_ptr<DrmDisplayPipeline>;
@@ -70,6 +124,11 @@ class ResourceManager {
 
   static auto GetTimeMonotonicNs() -> int64_t;
 
+  /* Phase of the vsync events sent to the client relative to the vblank,
+   * negative to wake the client up before it. Read whenever the client
+   * enables the vsync, so it can be tuned at runtime. */
+  static auto GetVsyncOffsetNs() -> int64_t;
+
  private:
   auto GetOrderedConnectors() -> std::vector<DrmConnector *>;
   void UpdateFrontendDisplays();
@@ -80,10 +139,20 @@ class ResourceManager {
   // Android properties:
   bool scale_with_gpu_{};
   CtmHandling ctm_handling_{};
+  int present_queue_depth_ = 1;
+  bool async_commit_{};
+  bool multi_crtc_commit_{};
+  int commit_thread_rt_priority_{};
+  uint64_t commit_thread_cpu_mask_{};
+  int64_t commit_margin_ns_{};
+  bool vrr_enabled_{};
+  bool idle_refresh_{};
+  bool writeback_flattening_{};
 
   std::shared_ptr<UEventListener> uevent_listener_;
+  std::shared_ptr<TimerService> timer_service_;
 
-  std::recursive_mutex main_lock_;
+  std::recursive_mutex topology_lock_;
 
   std::map<DrmConnector *, std::shared_ptr<DrmDisplayPipeline>>
       attached_pipelines_;
@@ -18,161 +18,338 @@
 
 #include "VSyncWorker.h"
 
-#include <xf86drm.h>
-#include <xf86drmMode.h>
-
-#include <cstdlib>
-#include <cstring>
-#include <ctime>
-
-#include "drm/ResourceManager.h"
+#include "drm/DrmEventListener.h"
 #include "utils/log.h"
 
 namespace android {
 
 auto VSyncWorker::CreateInstance(std::shared_ptr<DrmDisplayPipeline> &pipe,
-                                 VSyncWorkerCallbacks &callbacks)
+                                 VSyncWorkerCallbacks &callbacks,
+                                 std::shared_ptr<TimerService> timer_service)
     -> std::shared_ptr<VSyncWorker> {
+  if (!timer_service) {
+    return {};
+  }
+
   auto vsw = std::shared_ptr<VSyncWorker>(new VSyncWorker());
 
   vsw->callbacks_ = callbacks;
+  vsw->self_ = vsw;
+  vsw->timer_service_ = std::move(timer_service);
 
   if (pipe) {
-    vsw->high_crtc_ = pipe->crtc->Get()->GetIndexInResArray()
-                      << DRM_VBLANK_HIGH_CRTC_SHIFT;
-    vsw->drm_fd_ = pipe->device->GetFd();
+    vsw->listener_ = &pipe->device->GetEventListener();
+    vsw->crtc_id_ = pipe->crtc->Get()->GetId();
+    vsw->listener_->RegisterVblankHandler(
+        vsw->crtc_id_,
+        [weak_vsw = std::weak_ptr<VSyncWorker>(vsw)](
+            uint64_t /*sequence*/, int64_t timestamp_ns) {
+          auto vsw = weak_vsw.lock();
+          if (vsw) {
+            vsw->OnHardwareVSync(timestamp_ns);
+          }
+        });
   }
 
-  std::thread(&VSyncWorker::ThreadFn, vsw.get(), vsw).detach();
-
   return vsw;
 }
 
 void VSyncWorker::VSyncControl(bool enabled) {
-  {
-    const std::lock_guard<std::mutex> lock(mutex_);
-    enabled_ = enabled;
-    last_timestamp_ = -1;
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (enabled_ == enabled) {
+    return;
   }
 
-  cv_.notify_all();
+  enabled_ = enabled;
+  UpdateEvents();
 }
 
-void VSyncWorker::StopThread() {
-  {
-    const std::lock_guard<std::mutex> lock(mutex_);
-    thread_exit_ = true;
-    enabled_ = false;
-    callbacks_ = {};
+void VSyncWorker::RequestVSyncSample() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (tracking_) {
+    return;
   }
 
-  cv_.notify_all();
+  tracking_ = true;
+  UpdateEvents();
 }
 
-/*
- * Returns the timestamp of the next vsync in phase with last_timestamp_.
- * For example:
- *  last_timestamp_ = 137
- *  frame_ns = 50
- *  current = 683
- *
- *  ret = (50 * ((683 - 137)/50 + 1)) + 137
- *  ret = 687
- *
- *  Thus, we must sleep until timestamp 687 to maintain phase with the last
- *  timestamp.
- */
-int64_t VSyncWorker::GetPhasedVSync(int64_t frame_ns, int64_t current) const {
-  if (last_timestamp_ < 0)
-    return current + frame_ns;
+void VSyncWorker::UpdateEvents() {
+  if (enabled_ || tracking_) {
+    RequestNextVSync();
+  } else if (timer_id_ != 0) {
+    /* Queued vblank event is dropped on arrival */
+    timer_service_->Cancel(timer_id_);
+    timer_id_ = 0;
+  }
+}
+
+void VSyncWorker::Stop() {
+  std::unique_lock lock(mutex_);
+  enabled_ = false;
+  tracking_ = false;
+  callbacks_ = {};
+
+  if (timer_id_ != 0) {
+    timer_service_->Cancel(timer_id_);
+    timer_id_ = 0;
+  }
+
+  if (listener_ != nullptr) {
+    listener_->RegisterVblankHandler(crtc_id_, {});
+  }
 
-  return frame_ns * ((current - last_timestamp_) / frame_ns + 1) +
-         last_timestamp_;
+  for (auto &[id, channel] : channels_) {
+    CancelChannel(channel);
+  }
+  channels_.clear();
+  WaitForChannelCallback(lock, 0);
+}
+
+void VSyncWorker::SetVrrActive(bool vrr_active) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (vrr_active_ == vrr_active) {
+    return;
+  }
+
+  vrr_active_ = vrr_active;
+  /* Pending vblank event is replaced by the synthetic one on arrival, the
+   * synthetic one switches back to the vblank events */
+  if ((enabled_ || tracking_) && vrr_active_) {
+    RequestNextVSync();
+  }
 }
 
-static const int64_t kOneSecondNs = 1LL * 1000 * 1000 * 1000;
+auto VSyncWorker::GetVSyncPeriodNs() -> int64_t {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  UpdateNominalPeriod();
+  return model_.GetPeriodNs();
+}
 
-int VSyncWorker::SyntheticWaitVBlank(int64_t *timestamp) {
-  auto time_now = ResourceManager::GetTimeMonotonicNs();
+auto VSyncWorker::PredictNextVSyncNs(int64_t time_ns) -> int64_t {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  UpdateNominalPeriod();
+  return model_.PredictNextVSync(time_ns);
+}
+
+auto VSyncWorker::IsVSyncLocked() -> bool {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  return model_.IsLocked();
+}
 
+void VSyncWorker::UpdateNominalPeriod() {
   // Default to 60Hz refresh rate
   constexpr uint32_t kDefaultVSPeriodNs = 16666666;
   auto period_ns = kDefaultVSPeriodNs;
   if (callbacks_.get_vperiod_ns && callbacks_.get_vperiod_ns() != 0)
     period_ns = callbacks_.get_vperiod_ns();
 
-  auto phased_timestamp = GetPhasedVSync(period_ns, time_now);
-  struct timespec vsync {};
-  vsync.tv_sec = int(phased_timestamp / kOneSecondNs);
-  vsync.tv_nsec = int(phased_timestamp - (vsync.tv_sec * kOneSecondNs));
+  model_.SetNominalPeriod(period_ns);
+}
+
+auto VSyncWorker::AddOffsetChannel(int64_t offset_ns, ChannelCallback callback)
+    -> int {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  const int channel_id = ++last_channel_id_;
+  auto &channel = channels_[channel_id];
+  channel.offset_ns = offset_ns;
+  channel.callback = std::move(callback);
+  ScheduleChannel(channel_id, channel, TimerService::GetTimeNs());
+  return channel_id;
+}
+
+void VSyncWorker::SetChannelOffset(int channel_id, int64_t offset_ns) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  auto it = channels_.find(channel_id);
+  if (it == channels_.end() || it->second.offset_ns == offset_ns) {
+    return;
+  }
 
-  int ret = 0;
-  do {
-    ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &vsync, nullptr);
-  } while (ret == EINTR);
-  if (ret != 0)
-    return ret;
+  CancelChannel(it->second);
+  it->second.offset_ns = offset_ns;
+  ScheduleChannel(channel_id, it->second, TimerService::GetTimeNs());
+}
+
+void VSyncWorker::RemoveOffsetChannel(int channel_id) {
+  std::unique_lock lock(mutex_);
+  auto it = channels_.find(channel_id);
+  if (it == channels_.end()) {
+    return;
+  }
 
-  *timestamp = phased_timestamp;
-  return 0;
+  CancelChannel(it->second);
+  channels_.erase(it);
+  WaitForChannelCallback(lock, channel_id);
 }
 
-void VSyncWorker::ThreadFn(const std::shared_ptr<VSyncWorker> &vsw) {
-  int ret = 0;
+void VSyncWorker::WaitForChannelCallback(std::unique_lock<std::mutex> &lock,
+                                         int channel_id) {
+  if (running_channel_id_ == 0 ||
+      running_thread_ == std::this_thread::get_id()) {
+    return;
+  }
 
-  for (;;) {
-    {
-      std::unique_lock<std::mutex> lock(vsw->mutex_);
-      if (thread_exit_)
-        break;
+  channel_cv_.wait(lock, [this, channel_id] {
+    return running_channel_id_ == 0 ||
+           (channel_id != 0 && running_channel_id_ != channel_id);
+  });
+}
 
-      if (!enabled_)
-        vsw->cv_.wait(lock);
+void VSyncWorker::ScheduleChannel(int channel_id, OffsetChannel &channel,
+                                  int64_t after_ns) {
+  UpdateNominalPeriod();
 
-      if (!enabled_)
-        continue;
+  /* Fire time is after |after_ns|, the vsync itself may be before it */
+  const int64_t from_ns = after_ns - channel.offset_ns;
+  auto vsync_ns = model_.PredictNextVSync(from_ns);
+  if (vsync_ns == 0) {
+    /* Never synchronized, any phase will do */
+    vsync_ns = from_ns + model_.GetPeriodNs();
+  }
+
+  channel.timer_id = timer_service_->Schedule(
+      vsync_ns + channel.offset_ns,
+      [weak_vsw = self_, channel_id](int64_t time_ns) {
+        auto vsw = weak_vsw.lock();
+        if (vsw) {
+          vsw->OnChannelTimer(channel_id, time_ns);
+        }
+      });
+}
+
+void VSyncWorker::CancelChannel(OffsetChannel &channel) {
+  if (channel.timer_id != 0) {
+    timer_service_->Cancel(channel.timer_id);
+    channel.timer_id = 0;
+  }
+}
+
+void VSyncWorker::OnChannelTimer(int channel_id, int64_t time_ns) {
+  ChannelCallback callback;
+  int64_t vsync_ns = 0;
+
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    auto it = channels_.find(channel_id);
+    if (it == channels_.end()) {
+      return;
     }
 
-    ret = -EAGAIN;
-    int64_t timestamp = 0;
-    drmVBlank vblank{};
+    auto &channel = it->second;
+    vsync_ns = time_ns - channel.offset_ns;
+    callback = channel.callback;
+    ScheduleChannel(channel_id, channel, time_ns);
 
-    if (drm_fd_) {
-      vblank.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE |
-                                               (high_crtc_ &
-                                                DRM_VBLANK_HIGH_CRTC_MASK));
-      vblank.request.sequence = 1;
+    running_channel_id_ = channel_id;
+    running_thread_ = std::this_thread::get_id();
+  }
+
+  if (callback)
+    callback(vsync_ns, time_ns);
+
+  /* Captures of the callback are released before removal returns */
+  callback = {};
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    running_channel_id_ = 0;
+    running_thread_ = {};
+  }
+  channel_cv_.notify_all();
+}
 
-      ret = drmWaitVBlank(*drm_fd_, &vblank);
-      if (ret == -EINTR)
-        continue;
+void VSyncWorker::RequestNextVSync() {
+  if (listener_ != nullptr && !vrr_active_) {
+    if (hw_event_pending_) {
+      return;
     }
 
-    if (ret != 0) {
-      ret = SyntheticWaitVBlank(&timestamp);
-      if (ret != 0)
-        continue;
-    } else {
-      constexpr int kUsToNsMul = 1000;
-      timestamp = (int64_t)vblank.reply.tval_sec * kOneSecondNs +
-                  (int64_t)vblank.reply.tval_usec * kUsToNsMul;
+    if (listener_->QueueVblankEvent(crtc_id_) == 0) {
+      hw_event_pending_ = true;
+      return;
     }
+  }
 
-    decltype(callbacks_.out_event) callback;
+  if (timer_id_ != 0) {
+    return;
+  }
 
-    {
-      const std::lock_guard<std::mutex> lock(mutex_);
-      if (!enabled_)
-        continue;
-      callback = callbacks_.out_event;
+  UpdateNominalPeriod();
+  const int64_t now_ns = TimerService::GetTimeNs();
+  auto next_ns = model_.PredictNextVSync(now_ns);
+  if (next_ns == 0) {
+    /* Never synchronized, any phase will do */
+    next_ns = now_ns + model_.GetPeriodNs();
+  }
+
+  timer_id_ = timer_service_->Schedule(
+      next_ns,
+      [weak_vsw = self_](int64_t timestamp_ns) {
+        auto vsw = weak_vsw.lock();
+        if (vsw) {
+          vsw->OnSyntheticVSync(timestamp_ns);
+        }
+      });
+}
+
+void VSyncWorker::OnHardwareVSync(int64_t timestamp_ns) {
+  decltype(callbacks_.out_event) callback;
+
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    /* Event could be queued by the former worker of the CRTC */
+    if (!hw_event_pending_) {
+      return;
     }
 
-    if (callback)
-      callback(timestamp);
+    hw_event_pending_ = false;
+    if (vrr_active_) {
+      /* Vblank timestamp is off the grid, keep the model free-running */
+      tracking_ = false;
+      if (enabled_) {
+        RequestNextVSync();
+      }
+      return;
+    }
 
-    last_timestamp_ = timestamp;
+    UpdateNominalPeriod();
+    model_.AddSample(timestamp_ns);
+    /* Nobody wants the events anymore, keep them off */
+    tracking_ = false;
+    if (!enabled_) {
+      return;
+    }
+
+    /* Queue the next event ahead of the callback */
+    RequestNextVSync();
+    callback = callbacks_.out_event;
+  }
+
+  if (callback)
+    callback(timestamp_ns);
+}
+
+void VSyncWorker::OnSyntheticVSync(int64_t timestamp_ns) {
+  decltype(callbacks_.out_event) callback;
+
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    timer_id_ = 0;
+    /* Synthetic vsync is all the model gets while the CRTC is off */
+    tracking_ = false;
+    if (!enabled_) {
+      return;
+    }
+
+    if (model_.PredictNextVSync(timestamp_ns) == 0) {
+      /* Keep the phase of the synthetic vsync */
+      model_.AddSample(timestamp_ns);
+    }
+    /* Switches back to the vblank events once the CRTC is active */
+    RequestNextVSync();
+    callback = callbacks_.out_event;
   }
 
-  ALOGI("VSyncWorker thread exit");
+  if (callback)
+    callback(timestamp_ns);
 }
 }  // namespace android
@@ -19,48 +19,120 @@
 #include <condition_variable>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <thread>
 
 #include "DrmDevice.h"
+#include "utils/TimerService.h"
+#include "utils/VSyncModel.h"
 
 namespace android {
 
+class DrmEventListener;
+
 struct VSyncWorkerCallbacks {
   std::function<void(uint64_t /*timestamp*/)> out_event;
   std::function<uint32_t()> get_vperiod_ns;
 };
 
+/* Delivers the vblank events of the CRTC, received by the DrmEventListener
+ * of the device. Vsync is synthesized by the TimerService if the CRTC is off
+ * or there is no CRTC at all. No thread of its own.
+ */
 class VSyncWorker {
  public:
   ~VSyncWorker() = default;
 
   auto static CreateInstance(std::shared_ptr<DrmDisplayPipeline> &pipe,
-                             VSyncWorkerCallbacks &callbacks)
+                             VSyncWorkerCallbacks &callbacks,
+                             std::shared_ptr<TimerService> timer_service)
       -> std::shared_ptr<VSyncWorker>;
 
+  /* Client vsync events, delivered by the out_event callback */
   void VSyncControl(bool enabled);
-  void StopThread();
+  /* Keeps the vblank events on until the next one, which gives the vsync
+   * model a fresh reference. Not delivered to out_event. */
+  void RequestVSyncSample();
+  void Stop();
+
+  /* With variable refresh the vblanks follow the commits, so the vsync is
+   * synthesized at the nominal period of the mode instead */
+  void SetVrrActive(bool vrr_active);
+
+  /* Answered by the vsync model, the vblank events don't have to be on */
+  auto GetVSyncPeriodNs() -> int64_t;
+  /* First vsync after |time_ns|, 0 if never synchronized */
+  auto PredictNextVSyncNs(int64_t time_ns) -> int64_t;
+  /* The predictions follow the hardware vblanks */
+  auto IsVSyncLocked() -> bool;
+
+  /* Offset channels fire every period at the predicted vsync plus the
+   * offset, e.g. +N for an early client wakeup or -M for a composition
+   * deadline before the next vsync. Timers only, they work with the vblank
+   * events off. Callbacks are called from the TimerService thread.
+   * Removal waits for the running callback of the channel, unless called
+   * from that callback. */
+  using ChannelCallback =
+      std::function<void(int64_t /*vsync_ns*/, int64_t /*time_ns*/)>;
+  auto AddOffsetChannel(int64_t offset_ns, ChannelCallback callback) -> int;
+  void SetChannelOffset(int channel_id, int64_t offset_ns);
+  void RemoveOffsetChannel(int channel_id);
 
  private:
   VSyncWorker() = default;
 
-  void ThreadFn(const std::shared_ptr<VSyncWorker> &vsw);
+  /* Queues the vblank event, or schedules the synthetic one if the CRTC
+   * can't deliver it. Called with mutex_ held. */
+  void RequestNextVSync();
+  /* Starts or stops the events as wanted, called with mutex_ held */
+  void UpdateEvents();
+  void OnHardwareVSync(int64_t timestamp_ns);
+  void OnSyntheticVSync(int64_t timestamp_ns);
 
-  int64_t GetPhasedVSync(int64_t frame_ns, int64_t current) const;
-  int SyntheticWaitVBlank(int64_t *timestamp);
+  /* Follows the mode changes, called with mutex_ held */
+  void UpdateNominalPeriod();
+
+  struct OffsetChannel {
+    int64_t offset_ns;
+    ChannelCallback callback;
+    TimerService::TimerId timer_id;
+  };
+
+  /* Both called with mutex_ held */
+  void ScheduleChannel(int channel_id, OffsetChannel &channel,
+                       int64_t after_ns);
+  void CancelChannel(OffsetChannel &channel);
+
+  void OnChannelTimer(int channel_id, int64_t time_ns);
+  /* Waits until no callback of the channel is running, 0 means any channel.
+   * Called with mutex_ held. */
+  void WaitForChannelCallback(std::unique_lock<std::mutex> &lock,
+                              int channel_id);
 
   VSyncWorkerCallbacks callbacks_;
+  std::weak_ptr<VSyncWorker> self_;
 
-  SharedFd drm_fd_;
-  uint32_t high_crtc_ = 0;
+  DrmEventListener *listener_{};
+  uint32_t crtc_id_{};
+  bool hw_event_pending_{};
+  bool vrr_active_{};
+
+  std::shared_ptr<TimerService> timer_service_;
+  TimerService::TimerId timer_id_{};
 
   bool enabled_ = false;
-  bool thread_exit_ = false;
-  int64_t last_timestamp_ = -1;
+  bool tracking_ = false;
+  /* Fed by the vblank events, keeps predicting while they are off */
+  VSyncModel model_;
+
+  std::map<int, OffsetChannel> channels_;
+  int last_channel_id_{};
+  /* Channel whose callback is running, 0 if none */
+  int running_channel_id_{};
+  std::thread::id running_thread_;
+  std::condition_variable channel_cv_;
 
-  std::condition_variable cv_;
-  std::thread vswt_;
   std::mutex mutex_;
 };
 }  // namespace android
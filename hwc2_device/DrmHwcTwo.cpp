@@ -32,7 +32,7 @@ void DrmHwcTwo::FinalizeDisplayBinding() {
   if (displays_.count(kPrimaryDisplay) == 0) {
     /* Primary display MUST always exist */
     ALOGI("No pipelines available. Creating null-display for headless mode");
-    displays_[kPrimaryDisplay] = std::make_unique<
+    displays_[kPrimaryDisplay] = std::make_shared<
         HwcDisplay>(kPrimaryDisplay, HWC2::DisplayType::Physical, this);
     /* Initializes null-display */
     displays_[kPrimaryDisplay]->SetPipeline({});
@@ -56,7 +56,7 @@ void DrmHwcTwo::FinalizeDisplayBinding() {
 
   /* Wait 0.2s before removing the displays to flush pending HWC2 transactions
    */
-  auto &mutex = GetResMan().GetMainLock();
+  auto &mutex = GetResMan().GetTopologyLock();
   mutex.unlock();
   const int kTimeForSFToDisposeDisplayUs = 200000;
   usleep(kTimeForSFToDisposeDisplayUs);
@@ -81,7 +81,7 @@ bool DrmHwcTwo::BindDisplay(std::shared_ptr<DrmDisplayPipeline> pipeline) {
   }
 
   if (displays_.count(disp_handle) == 0) {
-    auto disp = std::make_unique<HwcDisplay>(disp_handle,
+    auto disp = std::make_shared<HwcDisplay>(disp_handle,
                                              HWC2::DisplayType::Physical, this);
     displays_[disp_handle] = std::move(disp);
   }
@@ -116,7 +116,7 @@ bool DrmHwcTwo::UnbindDisplay(std::shared_ptr<DrmDisplayPipeline> pipeline) {
 
   /* We must defer display disposal and removal, since it may still have pending
    * HWC_API calls scheduled and waiting until ueventlistener thread releases
-   * main lock, otherwise transaction may fail and SF may crash
+   * topology lock, otherwise transaction may fail and SF may crash
    */
   if (handle != kPrimaryDisplay) {
     displays_for_removal_list_.emplace_back(handle);
@@ -135,7 +135,7 @@ HWC2::Error DrmHwcTwo::CreateVirtualDisplay(
     return HWC2::Error::Unsupported;
 
   *display = ++last_display_handle_;
-  auto disp = std::make_unique<HwcDisplay>(*display, HWC2::DisplayType::Virtual,
+  auto disp = std::make_shared<HwcDisplay>(*display, HWC2::DisplayType::Virtual,
                                            this);
 
   disp->SetVirtualDisplayResolution(width, height);
@@ -156,7 +156,7 @@ HWC2::Error DrmHwcTwo::DestroyVirtualDisplay(hwc2_display_t display) {
 
   /* Wait 0.2s before removing the displays to flush pending HWC2 transactions
    */
-  auto &mutex = GetResMan().GetMainLock();
+  auto &mutex = GetResMan().GetTopologyLock();
   mutex.unlock();
   const int kTimeForSFToDisposeDisplayUs = 200000;
   usleep(kTimeForSFToDisposeDisplayUs);
@@ -178,8 +178,10 @@ void DrmHwcTwo::Dump(uint32_t *outSize, char *outBuffer) {
 
   output << "-- drm_hwcomposer --\n\n";
 
-  for (auto &disp : displays_)
+  for (auto &disp : displays_) {
+    const std::unique_lock lock(disp.second->GetDisplayLock());
     output << disp.second->Dump();
+  }
 
   mDumpString = output.str();
   *outSize = static_cast<uint32_t>(mDumpString.size());
@@ -205,7 +207,11 @@ HWC2::Error DrmHwcTwo::RegisterCallback(int32_t descriptor,
         resource_manager_.DeInit();
         /* Headless display may still be here. Remove it! */
         if (displays_.count(kPrimaryDisplay) != 0) {
-          displays_[kPrimaryDisplay]->Deinit();
+          {
+            auto &display = *displays_[kPrimaryDisplay];
+            const std::unique_lock lock(display.GetDisplayLock());
+            display.Deinit();
+          }
           displays_.erase(kPrimaryDisplay);
         }
       }
@@ -241,7 +247,7 @@ void DrmHwcTwo::SendHotplugEventToClient(hwc2_display_t displayid,
   auto hc = hotplug_callback_;
   if (hc.first != nullptr && hc.second != nullptr) {
     /* For some reason HWC Service will call HWC2 API in hotplug callback
-     * handler. This is the reason we're using recursive mutex.
+     * handler. This is the reason the topology lock is recursive.
      */
     hc.first(hc.second, displayid,
              connected == DRM_MODE_CONNECTED ? HWC2_CONNECTION_CONNECTED
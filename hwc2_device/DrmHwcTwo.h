@@ -46,10 +46,13 @@ class DrmHwcTwo : public PipelineToFrontendBindingInterface {
   HWC2::Error RegisterCallback(int32_t descriptor, hwc2_callback_data_t data,
                                hwc2_function_pointer_t function);
 
-  auto GetDisplay(hwc2_display_t display_handle) {
-    return displays_.count(display_handle) != 0
-               ? displays_[display_handle].get()
-               : nullptr;
+  /* Reference keeps the display alive if it is removed meanwhile, the
+   * display lock has to be taken to use it */
+  auto GetDisplay(hwc2_display_t display_handle)
+      -> std::shared_ptr<HwcDisplay> {
+    const std::unique_lock lock(resource_manager_.GetTopologyLock());
+    auto it = displays_.find(display_handle);
+    return it != displays_.end() ? it->second : nullptr;
   }
 
   auto &GetResMan() {
@@ -74,7 +77,7 @@ class DrmHwcTwo : public PipelineToFrontendBindingInterface {
   void SendHotplugEventToClient(hwc2_display_t displayid, bool connected) const;
 
   ResourceManager resource_manager_;
-  std::map<hwc2_display_t, std::unique_ptr<HwcDisplay>> displays_;
+  std::map<hwc2_display_t, std::shared_ptr<HwcDisplay>> displays_;
   std::map<std::shared_ptr<DrmDisplayPipeline>, hwc2_display_t>
       display_handles_;
 
@@ -41,6 +41,8 @@ std::string HwcDisplay::DumpDelta(HwcDisplay::Stats delta) {
              ? " !!! Internal failure, FIX it please\n"
              : "")
      << " Flattened frames: " << delta.frames_flattened_ << "\n"
+     << " Partially flattened frames: " << delta.frames_partially_flattened_
+     << "\n"
      << " Pixel operations (free units)"
      << " : [TOTAL: " << delta.total_pixops_ << " / GPU: " << delta.gpu_pixops_
      << "]\n"
@@ -55,8 +57,35 @@ std::string HwcDisplay::Dump() {
                             : GetPipe().connector->Get()->GetName();
 
   std::stringstream ss;
-  ss << "- Display on: " << connector_name << "\n"
-     << "Statistics since system boot:\n"
+  ss << "- Display on: " << connector_name << "\n";
+
+  if (!IsInHeadlessMode()) {
+    auto flip = GetPipe().atomic_state_manager->GetLastFlip();
+    ss << "Last flip: vblank " << flip.sequence << " at " << flip.timestamp_ns
+       << " ns\n";
+
+    auto fences = GetPipe().atomic_state_manager->GetAcquireFenceStats();
+    ss << "Acquire fences not signaled at commit: " << fences.late << " of "
+       << fences.total << "\n";
+
+    ss << "VRR: " << (configs_.vrr_capable ? "capable" : "not capable")
+       << (IsVrrWanted() ? ", active" : "") << "\n";
+  }
+
+  if (flatcon_) {
+    constexpr int64_t kNsInMs = 1000000;
+    auto stats = flatcon_->GetStats();
+    ss << "Flattening timeout: " << flatcon_->GetTimeoutNs() / kNsInMs
+       << " ms, flattened " << stats.flattens << " times, "
+       << stats.wasted << " undone before paying off";
+    if (stats.flattens > 0) {
+      ss << " (efficiency "
+         << 100 * (stats.flattens - stats.wasted) / stats.flattens << "%)";
+    }
+    ss << "\n";
+  }
+
+  ss << "Statistics since system boot:\n"
      << DumpDelta(total_stats_) << "\n\n"
      << "Statistics since last dumpsys request:\n"
      << DumpDelta(total_stats_.minus(prev_stats_)) << "\n\n";
@@ -88,6 +117,7 @@ void HwcDisplay::SetColorMarixToIdentity() {
 HwcDisplay::~HwcDisplay() = default;
 
 void HwcDisplay::SetPipeline(std::shared_ptr<DrmDisplayPipeline> pipeline) {
+  const std::unique_lock lock(display_lock_);
   Deinit();
 
   pipeline_ = std::move(pipeline);
@@ -123,17 +153,26 @@ void HwcDisplay::Deinit() {
 #endif
 
     current_plan_.reset();
+    wb_flatten_plan_.reset();
+    wb_flatten_layer_ = {};
+    wb_flatten_fbs_ = {};
+    GetPipe().atomic_state_manager->SetCaptureConnector(nullptr);
+    wb_flatten_connector_.reset();
+    wb_flatten_requested_ = false;
+    wb_flatten_failed_ = false;
     backend_.reset();
     if (flatcon_) {
-      flatcon_->StopThread();
+      flatcon_->Stop();
       flatcon_.reset();
     }
   }
 
   if (vsync_worker_) {
-    vsync_worker_->StopThread();
+    vsync_worker_->Stop();
     vsync_worker_ = {};
   }
+  vsync_offset_channel_ = 0;
+  vsync_offset_en_ = false;
 
   SetClientTarget(nullptr, -1, 0, {});
 }
@@ -144,28 +183,20 @@ HWC2::Error HwcDisplay::Init() {
   auto vsw_callbacks = (VSyncWorkerCallbacks){
       .out_event =
           [this](int64_t timestamp) {
-            const std::unique_lock lock(hwc2_->GetResMan().GetMainLock());
-            if (vsync_event_en_) {
-              uint32_t period_ns{};
-              GetDisplayVsyncPeriod(&period_ns);
-              hwc2_->SendVsyncEventToClient(handle_, timestamp, period_ns);
-            }
-            if (vsync_tracking_en_) {
-              last_vsync_ts_ = timestamp;
-            }
-            if (!vsync_event_en_ && !vsync_tracking_en_) {
-              vsync_worker_->VSyncControl(false);
+            /* Called from the device event thread, which serves all the
+             * displays, so no locks are taken here */
+            if (vsync_event_en_ && !vsync_offset_en_) {
+              hwc2_->SendVsyncEventToClient(handle_, timestamp,
+                                            client_vsync_period_ns_);
             }
           },
-      .get_vperiod_ns = [this]() -> uint32_t {
-        uint32_t outVsyncPeriod = 0;
-        GetDisplayVsyncPeriod(&outVsyncPeriod);
-        return outVsyncPeriod;
-      },
+      .get_vperiod_ns = [this]() -> uint32_t { return vsync_period_ns_; },
   };
 
   if (type_ != HWC2::DisplayType::Virtual) {
-    vsync_worker_ = VSyncWorker::CreateInstance(pipeline_, vsw_callbacks);
+    vsync_worker_ = VSyncWorker::CreateInstance(pipeline_, vsw_callbacks,
+                                                hwc2_->GetResMan()
+                                                    .GetTimerService());
     if (!vsync_worker_) {
       ALOGE("Failed to create event worker for d=%d\n", int(handle_));
       return HWC2::Error::BadDisplay;
@@ -184,10 +215,14 @@ HWC2::Error HwcDisplay::Init() {
         hwc2_->refresh_callback_.first(hwc2_->refresh_callback_.second,
                                        handle_);
     }};
-    flatcon_ = FlatteningController::CreateInstance(flatcbk);
+    flatcon_ = FlatteningController::CreateInstance(flatcbk,
+                                                    hwc2_->GetResMan()
+                                                        .GetTimerService());
+    BindWritebackFlatteningConnector();
   }
 
   client_layer_.SetLayerBlendMode(HWC2_BLEND_MODE_PREMULTIPLIED);
+  client_layer_.Latch();
 
   SetColorMarixToIdentity();
 
@@ -207,7 +242,10 @@ HWC2::Error HwcDisplay::ChosePreferredConfig() {
     return HWC2::Error::BadDisplay;
   }
 
-  return SetActiveConfig(configs_.preferred_config_id);
+  /* Client's config is the staged one */
+  auto ret = SetActiveConfig(configs_.preferred_config_id);
+  UpdateVsyncPeriod();
+  return ret;
 }
 
 HWC2::Error HwcDisplay::AcceptDisplayChanges() {
@@ -217,6 +255,9 @@ HWC2::Error HwcDisplay::AcceptDisplayChanges() {
 }
 
 HWC2::Error HwcDisplay::CreateLayer(hwc2_layer_t *layer) {
+  const std::unique_lock lock(layers_lock_);
+  composition_validated_ = false;
+  presented_composition_tested_ = false;
   layers_.emplace(static_cast<hwc2_layer_t>(layer_idx_), HwcLayer(this));
   *layer = static_cast<hwc2_layer_t>(layer_idx_);
   ++layer_idx_;
@@ -224,19 +265,25 @@ HWC2::Error HwcDisplay::CreateLayer(hwc2_layer_t *layer) {
 }
 
 HWC2::Error HwcDisplay::DestroyLayer(hwc2_layer_t layer) {
+  const std::unique_lock lock(layers_lock_);
   if (!get_layer(layer)) {
     return HWC2::Error::BadLayer;
   }
 
+  composition_validated_ = false;
+  presented_composition_tested_ = false;
   layers_.erase(layer);
   return HWC2::Error::None;
 }
 
 HWC2::Error HwcDisplay::GetActiveConfig(hwc2_config_t *config) const {
-  if (configs_.hwc_configs.count(staged_mode_config_id_) == 0)
+  /* Idle refresh switch is hidden from the client */
+  auto config_id = idle_restore_config_id_ != 0 ? idle_restore_config_id_
+                                                : staged_mode_config_id_;
+  if (configs_.hwc_configs.count(config_id) == 0)
     return HWC2::Error::BadConfig;
 
-  *config = staged_mode_config_id_;
+  *config = config_id;
   return HWC2::Error::None;
 }
 
@@ -435,7 +482,7 @@ HWC2::Error HwcDisplay::GetReleaseFences(uint32_t *num_elements,
   uint32_t num_layers = 0;
 
   for (auto &l : layers_) {
-    if (!l.second.GetPriorBufferScanOutFlag() || !present_fence_) {
+    if (!l.second.IsReleaseFencePending() || !release_fence_) {
       continue;
     }
 
@@ -450,13 +497,100 @@ HWC2::Error HwcDisplay::GetReleaseFences(uint32_t *num_elements,
     }
 
     layers[num_layers - 1] = l.first;
-    fences[num_layers - 1] = DupFd(present_fence_);
+    fences[num_layers - 1] = DupFd(release_fence_);
   }
   *num_elements = num_layers;
 
   return HWC2::Error::None;
 }
 
+/* Buffers sharing these parameters can be swapped without re-testing */
+static bool IsSameBufferLayout(const BufferInfo &a, const BufferInfo &b) {
+  return a.width == b.width && a.height == b.height && a.format == b.format &&
+         a.modifiers[0] == b.modifiers[0] && a.color_space == b.color_space &&
+         a.sample_range == b.sample_range && a.blend_mode == b.blend_mode;
+}
+
+/* Brings new buffers into the plan tested by ValidateDisplay(). Returns false
+ * if the plan can't be reused and the composition has to be re-created.
+ */
+bool HwcDisplay::UpdateValidatedComposition() {
+  if (!composition_validated_ || !current_plan_ || staged_mode_ ||
+      color_matrix_ || type_ == HWC2::DisplayType::Virtual) {
+    return false;
+  }
+
+  if (client_layer_.IsStateChanged()) {
+    return false;
+  }
+
+  for (auto &l : layers_) {
+    if (l.second.IsStateChanged()) {
+      return false;
+    }
+  }
+
+  auto &plan = current_plan_->plan;
+  if (plan.size() != z_order_.size()) {
+    return false;
+  }
+
+  /* Plan elements follow the z_order_ which was used to create the plan */
+  for (size_t i = 0; i < plan.size(); i++) {
+    auto *layer = z_order_[i].second;
+    layer->PopulateLayerData();
+
+    auto &layer_data = layer->GetLayerData();
+    auto &plan_layer_data = plan[i].layer;
+    if (!layer->IsLayerUsableAsDevice() || !layer_data.bi ||
+        !plan_layer_data.bi ||
+        !IsSameBufferLayout(*layer_data.bi, *plan_layer_data.bi)) {
+      return false;
+    }
+
+    plan_layer_data.bi = layer_data.bi;
+    plan_layer_data.fb = layer_data.fb;
+    plan_layer_data.acquire_fence = layer_data.acquire_fence;
+  }
+
+  return true;
+}
+
+bool HwcDisplay::ReusePresentedComposition() {
+  if (!presented_composition_tested_) {
+    return false;
+  }
+
+  for (auto &l : layers_) {
+    if ((l.second.GetChangedProperties() & ~HwcLayer::kBuffer) != 0) {
+      return false;
+    }
+  }
+
+  composition_validated_ = UpdateValidatedComposition();
+  return composition_validated_;
+}
+
+/* Client target is displayed alone if the kernel rejects the composition */
+void HwcDisplay::SetFallbackClientTarget(AtomicCommitArgs &a_args) {
+  for (auto &l : z_order_) {
+    if (l.second == &client_layer_) {
+      a_args.client_target = client_layer_.GetLayerData();
+      return;
+    }
+  }
+}
+
+bool HwcDisplay::IsVrrWanted() {
+  if (IsInHeadlessMode() || !GetPipe().crtc->Get()->GetVrrEnabledProperty() ||
+      !hwc2_->GetResMan().IsVrrEnabled()) {
+    return false;
+  }
+
+  auto it = configs_.hwc_configs.find(configs_.active_config_id);
+  return it != configs_.hwc_configs.end() && it->second.vrr;
+}
+
 HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
   if (IsInHeadlessMode()) {
     ALOGE("%s: Display is in headless mode, should never reach here", __func__);
@@ -464,9 +598,31 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
   }
 
   a_args.color_matrix = color_matrix_;
+  if (GetPipe().crtc->Get()->GetVrrEnabledProperty()) {
+    a_args.vrr_enabled = IsVrrWanted();
+  }
 
-  uint32_t prev_vperiod_ns = 0;
-  GetDisplayVsyncPeriod(&prev_vperiod_ns);
+  if (!a_args.test_only && UpdateValidatedComposition()) {
+    /* Nothing but buffers changed since ValidateDisplay(), skip re-creating
+     * the plan and re-encoding the tested atomic request */
+    a_args.composition = current_plan_;
+    a_args.reuse_validated = true;
+    SetFallbackClientTarget(a_args);
+
+    auto ret = GetPipe().atomic_state_manager->ExecuteAtomicCommit(a_args);
+    if (ret) {
+      ALOGE("Failed to apply the frame composition ret=%d", ret);
+      presented_composition_tested_ = false;
+      return HWC2::Error::BadParameter;
+    }
+
+    presented_composition_tested_ = true;
+    return HWC2::Error::None;
+  }
+
+  if (!a_args.test_only) {
+    presented_composition_tested_ = false;
+  }
 
   auto mode_update_commited_ = false;
   if (staged_mode_ &&
@@ -476,10 +632,13 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
                      .top = 0,
                      .right = int(staged_mode_->GetRawMode().hdisplay),
                      .bottom = int(staged_mode_->GetRawMode().vdisplay)});
+    client_layer_.Latch();
 
     configs_.active_config_id = staged_mode_config_id_;
+    UpdateVsyncPeriod();
 
     a_args.display_mode = *staged_mode_;
+    a_args.seamless = staged_mode_seamless_;
     if (!a_args.test_only) {
       mode_update_commited_ = true;
     }
@@ -488,11 +647,12 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
   // order the layers by z-order
   bool use_client_layer = false;
   uint32_t client_z_order = UINT32_MAX;
-  std::map<uint32_t, HwcLayer *> z_map;
+  auto &z_order = z_order_;
+  z_order.clear();
   for (std::pair<const hwc2_layer_t, HwcLayer> &l : layers_) {
     switch (l.second.GetValidatedType()) {
       case HWC2::Composition::Device:
-        z_map.emplace(l.second.GetZOrder(), &l.second);
+        z_order.emplace_back(l.second.GetZOrder(), &l.second);
         break;
       case HWC2::Composition::Client:
         // Place it at the z_order of the lowest client layer
@@ -504,20 +664,28 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
     }
   }
   if (use_client_layer)
-    z_map.emplace(client_z_order, &client_layer_);
+    z_order.emplace_back(client_z_order, &client_layer_);
 
-  if (z_map.empty())
+  if (z_order.empty())
     return HWC2::Error::BadLayer;
 
-  std::vector<LayerData> composition_layers;
+  /* Keep only the first layer for every z-position */
+  auto z_less = [](auto &a, auto &b) { return a.first < b.first; };
+  auto z_equal = [](auto &a, auto &b) { return a.first == b.first; };
+  std::stable_sort(z_order.begin(), z_order.end(), z_less);
+  z_order.erase(std::unique(z_order.begin(), z_order.end(), z_equal),
+                z_order.end());
 
   /* Import & populate */
-  for (std::pair<const uint32_t, HwcLayer *> &l : z_map) {
+  for (std::pair<uint32_t, HwcLayer *> &l : z_order) {
     l.second->PopulateLayerData();
   }
 
+  auto &composition_layers = composition_layers_;
+  composition_layers.clear();
+
   // now that they're ordered by z, add them to the composition
-  for (std::pair<const uint32_t, HwcLayer *> &l : z_map) {
+  for (std::pair<uint32_t, HwcLayer *> &l : z_order) {
     if (!l.second->IsLayerUsableAsDevice()) {
       /* This will be normally triggered on validation of the first frame
        * containing CLIENT layer. At this moment client buffer is not yet
@@ -532,10 +700,14 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
   }
 
   /* Store plan to ensure shared planes won't be stolen by other display
-   * in between of ValidateDisplay() and PresentDisplay() calls
+   * in between of ValidateDisplay() and PresentDisplay() calls.
+   * The plan object is reused across the frames to avoid allocations.
    */
-  current_plan_ = DrmKmsPlan::CreateDrmKmsPlan(GetPipe(),
-                                               std::move(composition_layers));
+  if (!current_plan_) {
+    current_plan_ = std::make_shared<DrmKmsPlan>();
+  }
+  auto planned = current_plan_->Update(GetPipe(), composition_layers);
+  composition_layers.clear();
 
   if (type_ == HWC2::DisplayType::Virtual) {
     a_args.writeback_fb = writeback_layer_->GetLayerData().fb;
@@ -543,7 +715,7 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
                                          .acquire_fence;
   }
 
-  if (!current_plan_) {
+  if (!planned) {
     if (!a_args.test_only) {
       ALOGE("Failed to create DrmKmsPlan");
     }
@@ -551,6 +723,9 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
   }
 
   a_args.composition = current_plan_;
+  if (!a_args.test_only) {
+    SetFallbackClientTarget(a_args);
+  }
 
   auto ret = GetPipe().atomic_state_manager->ExecuteAtomicCommit(a_args);
 
@@ -560,13 +735,15 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
     return HWC2::Error::BadParameter;
   }
 
+  if (a_args.test_only) {
+    composition_validated_ = true;
+  }
+
   if (mode_update_commited_) {
     staged_mode_.reset();
-    vsync_tracking_en_ = false;
-    if (last_vsync_ts_ != 0) {
-      hwc2_->SendVsyncPeriodTimingChangedEventToClient(handle_,
-                                                       last_vsync_ts_ +
-                                                           prev_vperiod_ns);
+    auto next_vsync_ns = GetNextVsyncNs(ResourceManager::GetTimeMonotonicNs());
+    if (next_vsync_ns != 0 && !std::exchange(staged_mode_idle_, false)) {
+      hwc2_->SendVsyncPeriodTimingChangedEventToClient(handle_, next_vsync_ns);
     }
   }
 
@@ -585,8 +762,17 @@ HWC2::Error HwcDisplay::PresentDisplay(int32_t *out_present_fence) {
 
   ++total_stats_.total_frames_;
 
+  LatchLayers();
+
   AtomicCommitArgs a_args{};
+  const bool wb_flatten = std::exchange(wb_flatten_requested_, false);
+  if (wb_flatten) {
+    wb_flatten_fb_index_ = (wb_flatten_fb_index_ + 1) %
+                           wb_flatten_fbs_.size();
+    a_args.capture_fb = wb_flatten_fbs_[wb_flatten_fb_index_];
+  }
   ret = CreateComposition(a_args);
+  composition_validated_ = false;
 
   if (ret != HWC2::Error::None)
     ++total_stats_.failed_kms_present_;
@@ -599,9 +785,25 @@ HWC2::Error HwcDisplay::PresentDisplay(int32_t *out_present_fence) {
   if (ret != HWC2::Error::None)
     return ret;
 
-  this->present_fence_ = a_args.out_fence;
   *out_present_fence = DupFd(a_args.out_fence);
 
+  if (wb_flatten) {
+    CommitWritebackFlattened(a_args);
+  }
+
+  if (vsync_worker_) {
+    vsync_worker_->SetVrrActive(IsVrrWanted());
+  }
+
+  /* Present fence is signaled at the same moment, use it if the release
+   * timeline isn't available */
+  release_fence_ = a_args.release_fence ? a_args.release_fence
+                                        : a_args.out_fence;
+  for (auto &l : layers_) {
+    l.second.UpdatePresentedFb(l.second.GetValidatedType() !=
+                               HWC2::Composition::Client);
+  }
+
   // Reset the color matrix so we don't apply it over and over again.
   color_matrix_ = {};
 
@@ -609,6 +811,244 @@ HWC2::Error HwcDisplay::PresentDisplay(int32_t *out_present_fence) {
   return HWC2::Error::None;
 }
 
+/* Bound before the display is activated, so the activation modeset attaches
+ * the connector to the CRTC */
+void HwcDisplay::BindWritebackFlatteningConnector() {
+  if (type_ == HWC2::DisplayType::Virtual ||
+      !hwc2_->GetResMan().IsWritebackFlatteningEnabled()) {
+    return;
+  }
+
+  auto &drm = *GetPipe().device;
+  auto &crtc = *GetPipe().crtc->Get();
+  for (const auto &conn : drm.GetWritebackConnectors()) {
+    auto reaches_crtc = std::any_of(drm.GetEncoders().begin(),
+                                    drm.GetEncoders().end(),
+                                    [&](const auto &enc) {
+                                      return conn->SupportsEncoder(*enc) &&
+                                             enc->SupportsCrtc(crtc);
+                                    });
+    if (!reaches_crtc) {
+      continue;
+    }
+
+    /* Keep the connector from being used by a virtual display */
+    wb_flatten_connector_ = conn->BindPipeline(pipeline_.get());
+    if (wb_flatten_connector_) {
+      ALOGI("Display %d: flattening using writeback connector %s",
+            int(handle_), conn->GetName().c_str());
+      GetPipe().atomic_state_manager->SetCaptureConnector(conn.get());
+      return;
+    }
+  }
+
+  ALOGI("Display %d: no writeback connector for the flattening",
+        int(handle_));
+}
+
+bool HwcDisplay::RequestWritebackFlattening() {
+  if (IsInHeadlessMode() || wb_flatten_failed_ || !wb_flatten_connector_) {
+    return false;
+  }
+
+  /* Not attached until the next modeset, flattened by the client meanwhile.
+   * Mode switch frame is flattened by the client as well. */
+  if (staged_mode_ ||
+      !GetPipe().atomic_state_manager->IsCaptureAttached() ||
+      !PrepareWritebackFlattening()) {
+    return false;
+  }
+
+  wb_flatten_requested_ = true;
+  return true;
+}
+
+bool HwcDisplay::PrepareWritebackFlattening() {
+  auto active = configs_.hwc_configs.find(configs_.active_config_id);
+  if (active == configs_.hwc_configs.end()) {
+    return false;
+  }
+
+  auto &mode = active->second.mode.GetRawMode();
+  const uint32_t width = mode.hdisplay;
+  const uint32_t height = mode.vdisplay;
+
+  auto &layer = wb_flatten_layer_;
+  if (!layer.bi || layer.bi->width != width || layer.bi->height != height) {
+    wb_flatten_fbs_ = {};
+    layer = {};
+    layer.bi = BufferInfo{
+        .width = width,
+        .height = height,
+        .format = DRM_FORMAT_XRGB8888,
+        .blend_mode = BufferBlendMode::kNone,
+    };
+    layer.pi.source_crop = {0, 0, float(width), float(height)};
+    layer.pi.display_frame = {0, 0, int(width), int(height)};
+
+    if (!GetPipe().primary_plane->Get()->IsValidForLayer(&layer)) {
+      ALOGW("Display %d: primary plane can't display the writeback buffer",
+            int(handle_));
+      wb_flatten_failed_ = true;
+      return false;
+    }
+  }
+
+  auto &fb = GetNextWritebackFb();
+  if (!fb) {
+    fb = DrmFbIdHandle::CreateDumbInstance(*GetPipe().device, width, height,
+                                           DRM_FORMAT_XRGB8888);
+    if (!fb) {
+      wb_flatten_failed_ = true;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Replaces the presented frame by its capture once the captured frame is
+ * displayed. Primary plane waits for the writeback fence, so nothing is waited
+ * for here. */
+void HwcDisplay::CommitWritebackFlattened(const AtomicCommitArgs &a_args) {
+  if (!a_args.capture_fence) {
+    ALOGW("Display %d: writeback flattening failed, using the client instead",
+          int(handle_));
+    wb_flatten_failed_ = true;
+    return;
+  }
+
+  if (!wb_flatten_plan_) {
+    wb_flatten_plan_ = std::make_shared<DrmKmsPlan>();
+  }
+
+  auto layer = wb_flatten_layer_;
+  layer.fb = a_args.capture_fb;
+  layer.acquire_fence = a_args.capture_fence;
+
+  auto &plan = wb_flatten_plan_->plan;
+  plan.clear();
+  plan.emplace_back(DrmKmsPlan::LayerToPlaneJoining{
+      .layer = std::move(layer),
+      .plane = GetPipe().primary_plane,
+      .z_pos = 0,
+  });
+
+  AtomicCommitArgs f_args{};
+  f_args.composition = wb_flatten_plan_;
+  if (GetPipe().atomic_state_manager->CommitAfterFlip(f_args) != 0) {
+    ALOGW("Display %d: failed to display the writeback buffer", int(handle_));
+    wb_flatten_failed_ = true;
+  }
+}
+
+bool HwcDisplay::IsSeamlessSwitch(uint32_t config) {
+  auto it = configs_.seamless_switches.find(
+      std::make_pair(configs_.active_config_id, config));
+  if (it != configs_.seamless_switches.end()) {
+    return it->second;
+  }
+
+  return ProbeSeamlessSwitch(config);
+}
+
+uint32_t HwcDisplay::GetIdleConfigId() {
+  if (IsInHeadlessMode() || !hwc2_->GetResMan().IsIdleRefreshEnabled() ||
+      IsVrrWanted()) {
+    return 0;
+  }
+
+  auto active = configs_.hwc_configs.find(configs_.active_config_id);
+  if (active == configs_.hwc_configs.end()) {
+    return 0;
+  }
+
+  uint32_t idle_config_id = 0;
+  float idle_vrefresh = active->second.mode.GetVRefresh();
+  for (auto &[id, hwc_config] : configs_.hwc_configs) {
+    if (hwc_config.disabled || hwc_config.group_id != active->second.group_id ||
+        hwc_config.mode.GetVRefresh() >= idle_vrefresh) {
+      continue;
+    }
+
+    idle_config_id = id;
+    idle_vrefresh = hwc_config.mode.GetVRefresh();
+  }
+
+  return idle_config_id;
+}
+
+void HwcDisplay::SetIdleRefresh(bool idle) {
+  if (idle == (idle_restore_config_id_ != 0)) {
+    return;
+  }
+
+  uint32_t config = 0;
+  uint32_t restore_config = 0;
+  if (idle) {
+    /* Don't interfere with the switch requested by the client */
+    if (staged_mode_) {
+      return;
+    }
+
+    config = GetIdleConfigId();
+    if (config == 0) {
+      return;
+    }
+
+    restore_config = configs_.active_config_id;
+  } else {
+    config = idle_restore_config_id_;
+  }
+
+  const bool seamless = IsSeamlessSwitch(config);
+  if (SetActiveConfigInternal(config, ResourceManager::GetTimeMonotonicNs()) !=
+      HWC2::Error::None) {
+    return;
+  }
+
+  staged_mode_seamless_ = seamless;
+  staged_mode_idle_ = true;
+  idle_restore_config_id_ = restore_config;
+  ALOGV("Display %d: %s idle refresh, config %u", int(handle_),
+        idle ? "entering" : "leaving", config);
+}
+
+bool HwcDisplay::ProbeSeamlessSwitch(uint32_t config) {
+  if (type_ == HWC2::DisplayType::Virtual || IsInHeadlessMode() ||
+      config == configs_.active_config_id) {
+    return false;
+  }
+
+  auto active = configs_.hwc_configs.find(configs_.active_config_id);
+  auto target = configs_.hwc_configs.find(config);
+  if (active == configs_.hwc_configs.end() ||
+      target == configs_.hwc_configs.end() || target->second.disabled ||
+      target->second.group_id != active->second.group_id) {
+    return false;
+  }
+
+  AtomicCommitArgs a_args{
+      .test_only = true,
+      .display_mode = target->second.mode,
+      .seamless = true,
+  };
+  auto err = GetPipe().atomic_state_manager->ExecuteAtomicCommit(a_args);
+  if (err == -EAGAIN) {
+    /* Display is off, probe once it is on */
+    return false;
+  }
+
+  const bool seamless = err == 0;
+  configs_.seamless_switches[std::make_pair(active->first, config)] = seamless;
+  if (seamless) {
+    ALOGI("Display %d: config %u is reachable seamlessly from config %u",
+          int(handle_), config, active->first);
+  }
+
+  return seamless;
+}
+
 HWC2::Error HwcDisplay::SetActiveConfigInternal(uint32_t config,
                                                 int64_t change_time) {
   if (configs_.hwc_configs.count(config) == 0) {
@@ -619,6 +1059,14 @@ HWC2::Error HwcDisplay::SetActiveConfigInternal(uint32_t config,
   staged_mode_ = configs_.hwc_configs[config].mode;
   staged_mode_change_time_ = change_time;
   staged_mode_config_id_ = config;
+  staged_mode_seamless_ = false;
+  staged_mode_idle_ = false;
+  idle_restore_config_id_ = 0;
+
+  if (vsync_worker_) {
+    /* Fresh vblanks keep the timing reported for the switch accurate */
+    vsync_worker_->RequestVSyncSample();
+  }
 
   return HWC2::Error::None;
 }
@@ -636,6 +1084,7 @@ HWC2::Error HwcDisplay::SetClientTarget(buffer_handle_t target,
                                         hwc_region_t /*damage*/) {
   client_layer_.SetLayerBuffer(target, acquire_fence);
   client_layer_.SetLayerDataspace(dataspace);
+  client_layer_.Latch();
 
   /*
    * target can be nullptr, this does mean the Composer Service is calling
@@ -668,6 +1117,7 @@ HWC2::Error HwcDisplay::SetClientTarget(buffer_handle_t target,
                                    .right = static_cast<float>(bi->width),
                                    .bottom = static_cast<float>(bi->height)};
   client_layer_.SetLayerSourceCrop(source_crop);
+  client_layer_.Latch();
 
   return HWC2::Error::None;
 }
@@ -740,6 +1190,7 @@ bool HwcDisplay::CtmByGpu() {
 HWC2::Error HwcDisplay::SetOutputBuffer(buffer_handle_t buffer,
                                         int32_t release_fence) {
   writeback_layer_->SetLayerBuffer(buffer, release_fence);
+  writeback_layer_->Latch();
   writeback_layer_->PopulateLayerData();
   if (!writeback_layer_->IsLayerUsableAsDevice()) {
     ALOGE("Output layer must be always usable by DRM/KMS");
@@ -753,6 +1204,7 @@ HWC2::Error HwcDisplay::SetPowerMode(int32_t mode_in) {
   auto mode = static_cast<HWC2::PowerMode>(mode_in);
 
   AtomicCommitArgs a_args{};
+  presented_composition_tested_ = false;
 
   switch (mode) {
     case HWC2::PowerMode::Off:
@@ -799,12 +1251,40 @@ HWC2::Error HwcDisplay::SetVsyncEnabled(int32_t enabled) {
   }
 
   vsync_event_en_ = HWC2_VSYNC_ENABLE == enabled;
-  if (vsync_event_en_) {
-    vsync_worker_->VSyncControl(true);
-  }
+  UpdateVsyncOffsetChannel();
+  /* Vblanks keep the vsync model locked for the offset channel too */
+  vsync_worker_->VSyncControl(vsync_event_en_);
   return HWC2::Error::None;
 }
 
+void HwcDisplay::UpdateVsyncOffsetChannel() {
+  const int64_t offset_ns = vsync_event_en_
+                                ? ResourceManager::GetVsyncOffsetNs()
+                                : 0;
+  if (offset_ns == 0) {
+    if (vsync_offset_channel_ != 0) {
+      vsync_offset_en_ = false;
+      RemoveVsyncOffsetChannel(std::exchange(vsync_offset_channel_, 0));
+    }
+    return;
+  }
+
+  if (vsync_offset_channel_ != 0) {
+    SetVsyncChannelOffset(vsync_offset_channel_, offset_ns);
+    return;
+  }
+
+  /* Timestamp carries the offset, so the client's vsync is shifted */
+  auto channel = AddVsyncOffsetChannel(offset_ns, [this](int64_t /*vsync_ns*/,
+                                                         int64_t time_ns) {
+    hwc2_->SendVsyncEventToClient(handle_, time_ns, client_vsync_period_ns_);
+  });
+  if (channel > 0) {
+    vsync_offset_channel_ = channel;
+    vsync_offset_en_ = true;
+  }
+}
+
 HWC2::Error HwcDisplay::ValidateDisplay(uint32_t *num_types,
                                         uint32_t *num_requests) {
   if (IsInHeadlessMode()) {
@@ -812,21 +1292,36 @@ HWC2::Error HwcDisplay::ValidateDisplay(uint32_t *num_types,
     return HWC2::Error::None;
   }
 
-  /* In current drm_hwc design in case previous frame layer was not validated as
-   * a CLIENT, it is used by display controller (Front buffer). We have to store
-   * this state to provide the CLIENT with the release fences for such buffers.
-   */
+  LatchLayers();
+
+  const int64_t now_ns = ResourceManager::GetTimeMonotonicNs();
   for (auto &l : layers_) {
-    l.second.SetPriorBufferScanOutFlag(l.second.GetValidatedType() !=
-                                       HWC2::Composition::Client);
+    l.second.LatchUpdateTime(now_ns);
   }
+  composition_validated_ = false;
+  wb_flatten_requested_ = false;
 
-  return backend_->ValidateDisplay(this, num_types, num_requests);
+  /* Backend may look at the properties changed by this frame */
+  auto ret = backend_->ValidateDisplay(this, num_types, num_requests);
+
+  for (auto &l : layers_) {
+    l.second.ClearStateChanged();
+  }
+  client_layer_.ClearStateChanged();
+
+  return ret;
+}
+
+void HwcDisplay::LatchLayers() {
+  const std::unique_lock lock(layers_lock_);
+  for (auto &l : layers_) {
+    l.second.Latch();
+  }
 }
 
-std::vector<HwcLayer *> HwcDisplay::GetOrderLayersByZPos() {
-  std::vector<HwcLayer *> ordered_layers;
-  ordered_layers.reserve(layers_.size());
+std::vector<HwcLayer *> &HwcDisplay::GetOrderLayersByZPos() {
+  auto &ordered_layers = ordered_layers_;
+  ordered_layers.clear();
 
   for (auto &[handle, layer] : layers_) {
     ordered_layers.emplace_back(&layer);
@@ -840,10 +1335,70 @@ std::vector<HwcLayer *> HwcDisplay::GetOrderLayersByZPos() {
   return ordered_layers;
 }
 
+size_t HwcDisplay::CountUsablePlanes() {
+  GetPipe().GetUsablePlanes(usable_planes_);
+  const size_t count = usable_planes_.size();
+  /* Don't keep the overlay planes bound to this display */
+  usable_planes_.clear();
+  return count;
+}
+
+int64_t HwcDisplay::GetNextVsyncNs(int64_t time_ns) {
+  if (!vsync_worker_) {
+    return 0;
+  }
+
+  /* Re-lock the model on the vblank events, answer with the current
+   * prediction meanwhile */
+  if (!vsync_worker_->IsVSyncLocked()) {
+    vsync_worker_->RequestVSyncSample();
+  }
+
+  return vsync_worker_->PredictNextVSyncNs(time_ns);
+}
+
+int HwcDisplay::AddVsyncOffsetChannel(int64_t offset_ns,
+                                      VSyncWorker::ChannelCallback callback) {
+  if (!vsync_worker_) {
+    return -EINVAL;
+  }
+
+  return vsync_worker_->AddOffsetChannel(offset_ns, std::move(callback));
+}
+
+void HwcDisplay::SetVsyncChannelOffset(int channel_id, int64_t offset_ns) {
+  if (vsync_worker_) {
+    vsync_worker_->SetChannelOffset(channel_id, offset_ns);
+  }
+}
+
+void HwcDisplay::RemoveVsyncOffsetChannel(int channel_id) {
+  if (vsync_worker_) {
+    vsync_worker_->RemoveOffsetChannel(channel_id);
+  }
+}
+
+void HwcDisplay::UpdateVsyncPeriod() {
+  int32_t period_ns = 0;
+  GetDisplayAttribute(configs_.active_config_id, HWC2_ATTRIBUTE_VSYNC_PERIOD,
+                      &period_ns);
+  vsync_period_ns_ = period_ns;
+
+  uint32_t client_period_ns = 0;
+  GetDisplayVsyncPeriod(&client_period_ns);
+  client_vsync_period_ns_ = client_period_ns;
+}
+
+/* Period of the client's config, see idle_restore_config_id_ */
 HWC2::Error HwcDisplay::GetDisplayVsyncPeriod(
     uint32_t *outVsyncPeriod /* ns */) {
-  return GetDisplayAttribute(configs_.active_config_id,
-                             HWC2_ATTRIBUTE_VSYNC_PERIOD,
+  hwc2_config_t config = 0;
+  auto err = GetActiveConfig(&config);
+  if (err != HWC2::Error::None) {
+    return err;
+  }
+
+  return GetDisplayAttribute(config, HWC2_ATTRIBUTE_VSYNC_PERIOD,
                              (int32_t *)(outVsyncPeriod));
 }
 
@@ -881,7 +1436,8 @@ HWC2::Error HwcDisplay::SetActiveConfigWithConstraints(
   uint32_t current_vsync_period{};
   GetDisplayVsyncPeriod(&current_vsync_period);
 
-  if (vsyncPeriodChangeConstraints->seamlessRequired) {
+  const bool seamless = IsSeamlessSwitch(config);
+  if (vsyncPeriodChangeConstraints->seamlessRequired && !seamless) {
     return HWC2::Error::SeamlessNotAllowed;
   }
 
@@ -892,15 +1448,11 @@ HWC2::Error HwcDisplay::SetActiveConfigWithConstraints(
   if (ret != HWC2::Error::None) {
     return ret;
   }
+  staged_mode_seamless_ = seamless;
 
   outTimeline->refreshRequired = true;
   outTimeline->newVsyncAppliedTimeNanos = vsyncPeriodChangeConstraints
                                               ->desiredTimeNanos;
-
-  last_vsync_ts_ = 0;
-  vsync_tracking_en_ = true;
-  vsync_worker_->VSyncControl(true);
-
   return HWC2::Error::None;
 }
 
@@ -18,7 +18,9 @@
 
 #include <hardware/hwcomposer2.h>
 
+#include <array>
 #include <atomic>
+#include <mutex>
 #include <optional>
 #include <sstream>
 
@@ -47,8 +49,25 @@ class HwcDisplay {
   /* SetPipeline should be carefully used only by DrmHwcTwo hotplug handlers */
   void SetPipeline(std::shared_ptr<DrmDisplayPipeline> pipeline);
 
+  /* Guards the display state, so the HWC2 calls for different displays run
+   * in parallel. Recursive, since the client may call the HAL back from the
+   * callbacks sent by the display. Taken after the topology lock. */
+  auto &GetDisplayLock() {
+    return display_lock_;
+  }
+
+  /* Guards the layer map and the pending layer state, so the layer hooks
+   * don't wait for a composition in progress. Taken after the display lock.
+   */
+  auto &GetLayersLock() {
+    return layers_lock_;
+  }
+
   HWC2::Error CreateComposition(AtomicCommitArgs &a_args);
-  std::vector<HwcLayer *> GetOrderLayersByZPos();
+  /* Valid until the next call, the storage is reused between the frames */
+  std::vector<HwcLayer *> &GetOrderLayersByZPos();
+  /* Planes the composition of this display can use at the moment */
+  size_t CountUsablePlanes();
 
   void ClearDisplay();
 
@@ -101,6 +120,17 @@ class HwcDisplay {
   HWC2::Error SetContentType(int32_t contentType);
 #endif
   HWC2::Error GetDisplayVsyncPeriod(uint32_t *outVsyncPeriod);
+  /* Predicted by the vsync model, 0 if the display was never synchronized.
+   * The vblank events are only sampled while the model isn't locked */
+  int64_t GetNextVsyncNs(int64_t time_ns);
+
+  /* Vsync phase offset channels, see VSyncWorker. Returns the channel id or
+   * a negative value for the virtual displays. Channels are dropped on the
+   * Deinit(). */
+  int AddVsyncOffsetChannel(int64_t offset_ns,
+                            VSyncWorker::ChannelCallback callback);
+  void SetVsyncChannelOffset(int channel_id, int64_t offset_ns);
+  void RemoveVsyncOffsetChannel(int channel_id);
 
   HWC2::Error GetDozeSupport(int32_t *support);
   HWC2::Error GetHdrCapabilities(uint32_t *num_types, int32_t *types,
@@ -135,7 +165,8 @@ class HwcDisplay {
               gpu_pixops_ - b.gpu_pixops_,
               failed_kms_validate_ - b.failed_kms_validate_,
               failed_kms_present_ - b.failed_kms_present_,
-              frames_flattened_ - b.frames_flattened_};
+              frames_flattened_ - b.frames_flattened_,
+              frames_partially_flattened_ - b.frames_partially_flattened_};
     }
 
     uint32_t total_frames_ = 0;
@@ -144,6 +175,7 @@ class HwcDisplay {
     uint32_t failed_kms_validate_ = 0;
     uint32_t failed_kms_present_ = 0;
     uint32_t frames_flattened_ = 0;
+    uint32_t frames_partially_flattened_ = 0;
   };
 
   const Backend *backend() const;
@@ -183,6 +215,22 @@ class HwcDisplay {
     return flatcon_;
   }
 
+  /* Lowest refresh config of the active mode group, 0 if there is none or
+   * the idle refresh is disabled */
+  uint32_t GetIdleConfigId();
+  /* Switches to the idle config and back, the switch is committed by the
+   * next present */
+  void SetIdleRefresh(bool idle);
+
+  /* Only the buffers changed since the presented composition, which passed
+   * the test with the same layer types. Brings the new buffers into it, so
+   * the frame needs no test commit. */
+  bool ReusePresentedComposition();
+
+  /* Flattens the next presented frame using a writeback connector instead of
+   * the client. Returns false if the display can't do that. */
+  bool RequestWritebackFlattening();
+
   auto &GetWritebackLayer() {
     return writeback_layer_;
   }
@@ -197,27 +245,53 @@ class HwcDisplay {
 
   DrmHwcTwo *const hwc2_;
 
-  SharedFd present_fence_;
+  /* Signaled once the buffers replaced by the last frame are released */
+  SharedFd release_fence_;
 
   std::optional<DrmMode> staged_mode_;
   int64_t staged_mode_change_time_{};
   uint32_t staged_mode_config_id_{};
+  bool staged_mode_seamless_{};
+  /* Config chosen by the client while the idle config is displayed. The idle
+   * switch is hidden from the client: GetActiveConfig(), the vsync period and
+   * the vsync events report the client's config, and no timing change is
+   * reported for the switch. */
+  uint32_t idle_restore_config_id_{};
+  /* Staged switch enters or leaves the idle refresh */
+  bool staged_mode_idle_{};
+  /* Tested once per config pair, when the switch is requested */
+  bool IsSeamlessSwitch(uint32_t config);
+  /* TEST_ONLY switch from the active config, the result is stored in the
+   * HwcDisplayConfigs */
+  bool ProbeSeamlessSwitch(uint32_t config);
 
   std::shared_ptr<DrmDisplayPipeline> pipeline_;
 
   std::unique_ptr<Backend> backend_;
   std::shared_ptr<FlatteningController> flatcon_;
 
+  std::recursive_mutex display_lock_;
+
+  /* Vsync events are delivered without taking the display lock, so they
+   * don't wait for the commit in progress */
   std::shared_ptr<VSyncWorker> vsync_worker_;
-  bool vsync_event_en_{};
-  bool vsync_tracking_en_{};
-  int64_t last_vsync_ts_{};
+  std::atomic<bool> vsync_event_en_{};
+  /* Client vsync is sent by the offset channel instead of the vblank */
+  int vsync_offset_channel_{};
+  std::atomic<bool> vsync_offset_en_{};
+  void UpdateVsyncOffsetChannel();
+  /* Period of the active config */
+  /* Of the displayed config, and of the config reported to the client */
+  std::atomic<uint32_t> vsync_period_ns_{};
+  std::atomic<uint32_t> client_vsync_period_ns_{};
+  void UpdateVsyncPeriod();
 
   const hwc2_display_t handle_;
   HWC2::DisplayType type_;
 
   uint32_t layer_idx_{};
 
+  std::mutex layers_lock_;
   std::map<hwc2_layer_t, HwcLayer> layers_;
   HwcLayer client_layer_;
   std::unique_ptr<HwcLayer> writeback_layer_;
@@ -230,6 +304,42 @@ class HwcDisplay {
   android_color_transform_t color_transform_hint_{};
 
   std::shared_ptr<DrmKmsPlan> current_plan_;
+  /* current_plan_ passed the test commit within ValidateDisplay() */
+  bool composition_validated_{};
+  /* Presented frame used the tested current_plan_ */
+  bool presented_composition_tested_{};
+  bool UpdateValidatedComposition();
+  /* Applies the pending state of all the layers */
+  void LatchLayers();
+  void SetFallbackClientTarget(AtomicCommitArgs &a_args);
+
+  /* Active config is VRR and the variable refresh is enabled */
+  bool IsVrrWanted();
+
+  /* Writeback flattening. The presented frame is captured into one of the
+   * buffers, which is then displayed alone on the primary plane. Buffers are
+   * alternated to never write into the one being scanned out. */
+  void BindWritebackFlatteningConnector();
+  bool wb_flatten_requested_{};
+  bool wb_flatten_failed_{};
+  std::shared_ptr<BindingOwner<DrmConnector>> wb_flatten_connector_;
+  std::array<std::shared_ptr<DrmFbIdHandle>, 2> wb_flatten_fbs_;
+  size_t wb_flatten_fb_index_{};
+  LayerData wb_flatten_layer_;
+  std::shared_ptr<DrmKmsPlan> wb_flatten_plan_;
+  /* Allocates the buffer to capture into */
+  bool PrepareWritebackFlattening();
+  /* Not scanned out, the index is advanced once the capture is presented */
+  auto &GetNextWritebackFb() {
+    return wb_flatten_fbs_[(wb_flatten_fb_index_ + 1) % wb_flatten_fbs_.size()];
+  }
+  void CommitWritebackFlattened(const AtomicCommitArgs &a_args);
+
+  /* Per-frame scratch storage, kept between the frames to avoid allocations */
+  std::vector<std::pair<uint32_t, HwcLayer *>> z_order_;
+  std::vector<LayerData> composition_layers_;
+  std::vector<HwcLayer *> ordered_layers_;
+  std::vector<std::shared_ptr<BindingOwner<DrmPlane>>> usable_planes_;
 
   uint32_t frame_no_ = 0;
   Stats total_stats_;
@@ -55,6 +55,7 @@ void HwcDisplayConfigs::GenFakeMode(uint16_t width, uint16_t height) {
         kHeadlessModeDisplayHeightPx, kHeadlessModeDisplayVRefresh);
 
   hwc_configs.clear();
+  seamless_switches.clear();
 
   last_config_id++;
   preferred_config_id = active_config_id = last_config_id;
@@ -98,6 +99,7 @@ void HwcDisplayConfigs::GenFakeMode(uint16_t width, uint16_t height) {
 
   mm_width = kHeadlessModeDisplayWidthMm;
   mm_height = kHeadlessModeDisplayHeightMm;
+  vrr_capable = false;
 }
 
 // NOLINTNEXTLINE (readability-function-cognitive-complexity): Fixme
@@ -118,9 +120,15 @@ HWC2::Error HwcDisplayConfigs::Update(DrmConnector &connector) {
     return HWC2::Error::BadDisplay;
   }
 
+  /* Config ids are re-assigned, and the sink may have changed */
   hwc_configs.clear();
+  seamless_switches.clear();
   mm_width = connector.GetMmWidth();
   mm_height = connector.GetMmHeight();
+  vrr_capable = connector.IsVrrCapable();
+  if (vrr_capable) {
+    ALOGI("Connector %s is VRR capable", connector.GetName().c_str());
+  }
 
   preferred_config_id = 0;
   uint32_t preferred_config_group_id = 0;
@@ -157,6 +165,9 @@ HWC2::Error HwcDisplayConfigs::Update(DrmConnector &connector) {
         .group_id = group_found,
         .mode = mode,
         .disabled = disabled,
+        /* Interlaced modes can't vary the refresh */
+        .vrr = vrr_capable &&
+               (mode.GetRawMode().flags & DRM_MODE_FLAG_INTERLACE) == 0,
     };
 
     /* Chwck if the mode is preferred */
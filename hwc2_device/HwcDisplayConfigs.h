@@ -19,6 +19,7 @@
 #include <hardware/hwcomposer2.h>
 
 #include <map>
+#include <utility>
 
 #include "drm/DrmMode.h"
 
@@ -31,6 +32,8 @@ struct HwcDisplayConfig {
   uint32_t group_id{};
   DrmMode mode{};
   bool disabled{};
+  /* Variable refresh, the mode refresh rate is the upper bound */
+  bool vrr{};
 
   bool IsInterlaced() const {
     return (mode.GetRawMode().flags & DRM_MODE_FLAG_INTERLACE) != 0;
@@ -51,6 +54,14 @@ struct HwcDisplayConfigs {
 
   uint32_t mm_width = 0;
   uint32_t mm_height = 0;
+
+  /* Connected sink supports the adaptive sync */
+  bool vrr_capable = false;
+
+  /* Probed config switches, true if the kernel accepts the switch without a
+   * modeset */
+  std::map<std::pair<uint32_t /*from*/, uint32_t /*to*/>, bool>
+      seamless_switches;
 };
 
 }  // namespace android
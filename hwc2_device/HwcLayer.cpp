@@ -18,12 +18,20 @@
 
 #include "HwcLayer.h"
 
+#include <utility>
+
 #include "HwcDisplay.h"
 #include "bufferinfo/BufferInfoGetter.h"
 #include "utils/log.h"
 
 namespace android {
 
+template <typename T>
+static bool IsSameRect(const T &a, const T &b) {
+  return a.left == b.left && a.top == b.top && a.right == b.right &&
+         a.bottom == b.bottom;
+}
+
 // NOLINTNEXTLINE(readability-convert-member-functions-to-static)
 HWC2::Error HwcLayer::SetCursorPosition(int32_t /*x*/, int32_t /*y*/) {
   return HWC2::Error::None;
@@ -32,19 +40,20 @@ HWC2::Error HwcLayer::SetCursorPosition(int32_t /*x*/, int32_t /*y*/) {
 HWC2::Error HwcLayer::SetLayerBlendMode(int32_t mode) {
   switch (static_cast<HWC2::BlendMode>(mode)) {
     case HWC2::BlendMode::None:
-      blend_mode_ = BufferBlendMode::kNone;
+      pending_.blend_mode = BufferBlendMode::kNone;
       break;
     case HWC2::BlendMode::Premultiplied:
-      blend_mode_ = BufferBlendMode::kPreMult;
+      pending_.blend_mode = BufferBlendMode::kPreMult;
       break;
     case HWC2::BlendMode::Coverage:
-      blend_mode_ = BufferBlendMode::kCoverage;
+      pending_.blend_mode = BufferBlendMode::kCoverage;
       break;
     default:
-      ALOGE("Unknown blending mode b=%d", blend_mode_);
-      blend_mode_ = BufferBlendMode::kUndefined;
+      ALOGE("Unknown blending mode b=%d", mode);
+      pending_.blend_mode = BufferBlendMode::kUndefined;
       break;
   }
+  pending_.written |= kBlendMode;
   return HWC2::Error::None;
 }
 
@@ -53,9 +62,9 @@ HWC2::Error HwcLayer::SetLayerBlendMode(int32_t mode) {
  */
 HWC2::Error HwcLayer::SetLayerBuffer(buffer_handle_t buffer,
                                      int32_t acquire_fence) {
-  layer_data_.acquire_fence = MakeSharedFd(acquire_fence);
-  buffer_handle_ = buffer;
-  buffer_handle_updated_ = true;
+  pending_.acquire_fence = MakeSharedFd(acquire_fence);
+  pending_.buffer_handle = buffer;
+  pending_.written |= kBuffer;
 
   return HWC2::Error::None;
 }
@@ -67,49 +76,53 @@ HWC2::Error HwcLayer::SetLayerColor(hwc_color_t /*color*/) {
 }
 
 HWC2::Error HwcLayer::SetLayerCompositionType(int32_t type) {
-  sf_type_ = static_cast<HWC2::Composition>(type);
+  pending_.sf_type = static_cast<HWC2::Composition>(type);
+  pending_.written |= kCompositionType;
   return HWC2::Error::None;
 }
 
 HWC2::Error HwcLayer::SetLayerDataspace(int32_t dataspace) {
   switch (dataspace & HAL_DATASPACE_STANDARD_MASK) {
     case HAL_DATASPACE_STANDARD_BT709:
-      color_space_ = BufferColorSpace::kItuRec709;
+      pending_.color_space = BufferColorSpace::kItuRec709;
       break;
     case HAL_DATASPACE_STANDARD_BT601_625:
     case HAL_DATASPACE_STANDARD_BT601_625_UNADJUSTED:
     case HAL_DATASPACE_STANDARD_BT601_525:
     case HAL_DATASPACE_STANDARD_BT601_525_UNADJUSTED:
-      color_space_ = BufferColorSpace::kItuRec601;
+      pending_.color_space = BufferColorSpace::kItuRec601;
       break;
     case HAL_DATASPACE_STANDARD_BT2020:
     case HAL_DATASPACE_STANDARD_BT2020_CONSTANT_LUMINANCE:
-      color_space_ = BufferColorSpace::kItuRec2020;
+      pending_.color_space = BufferColorSpace::kItuRec2020;
       break;
     default:
-      color_space_ = BufferColorSpace::kUndefined;
+      pending_.color_space = BufferColorSpace::kUndefined;
   }
 
   switch (dataspace & HAL_DATASPACE_RANGE_MASK) {
     case HAL_DATASPACE_RANGE_FULL:
-      sample_range_ = BufferSampleRange::kFullRange;
+      pending_.sample_range = BufferSampleRange::kFullRange;
       break;
     case HAL_DATASPACE_RANGE_LIMITED:
-      sample_range_ = BufferSampleRange::kLimitedRange;
+      pending_.sample_range = BufferSampleRange::kLimitedRange;
       break;
     default:
-      sample_range_ = BufferSampleRange::kUndefined;
+      pending_.sample_range = BufferSampleRange::kUndefined;
   }
+  pending_.written |= kDataspace;
   return HWC2::Error::None;
 }
 
 HWC2::Error HwcLayer::SetLayerDisplayFrame(hwc_rect_t frame) {
-  layer_data_.pi.display_frame = frame;
+  pending_.pi.display_frame = frame;
+  pending_.written |= kDisplayFrame;
   return HWC2::Error::None;
 }
 
 HWC2::Error HwcLayer::SetLayerPlaneAlpha(float alpha) {
-  layer_data_.pi.alpha = std::lround(alpha * UINT16_MAX);
+  pending_.pi.alpha = std::lround(alpha * UINT16_MAX);
+  pending_.written |= kPlaneAlpha;
   return HWC2::Error::None;
 }
 
@@ -121,7 +134,8 @@ HWC2::Error HwcLayer::SetLayerSidebandStream(
 }
 
 HWC2::Error HwcLayer::SetLayerSourceCrop(hwc_frect_t crop) {
-  layer_data_.pi.source_crop = crop;
+  pending_.pi.source_crop = crop;
+  pending_.written |= kSourceCrop;
   return HWC2::Error::None;
 }
 
@@ -151,7 +165,8 @@ HWC2::Error HwcLayer::SetLayerTransform(int32_t transform) {
       l_transform |= LayerTransform::kRotate90;
   }
 
-  layer_data_.pi.transform = static_cast<LayerTransform>(l_transform);
+  pending_.pi.transform = static_cast<LayerTransform>(l_transform);
+  pending_.written |= kTransform;
   return HWC2::Error::None;
 }
 
@@ -162,10 +177,75 @@ HWC2::Error HwcLayer::SetLayerVisibleRegion(hwc_region_t /*visible*/) {
 }
 
 HWC2::Error HwcLayer::SetLayerZOrder(uint32_t order) {
-  z_order_ = order;
+  pending_.z_order = order;
+  pending_.written |= kZOrder;
   return HWC2::Error::None;
 }
 
+void HwcLayer::Latch() {
+  auto written = std::exchange(pending_.written, 0);
+  if (written == 0) {
+    return;
+  }
+
+  uint32_t changed = 0;
+  auto &pi = layer_data_.pi;
+
+  if ((written & kBuffer) != 0) {
+    /* Front-buffer producers draw into the same buffer, a new acquire fence
+     * tells the content is updated */
+    if (buffer_handle_ != pending_.buffer_handle || pending_.acquire_fence)
+      changed |= kBuffer;
+    buffer_handle_ = pending_.buffer_handle;
+    layer_data_.acquire_fence = std::move(pending_.acquire_fence);
+    buffer_handle_updated_ = true;
+  }
+  if ((written & kCompositionType) != 0) {
+    if (sf_type_ != pending_.sf_type)
+      changed |= kCompositionType;
+    sf_type_ = pending_.sf_type;
+  }
+  if ((written & kZOrder) != 0) {
+    if (z_order_ != pending_.z_order)
+      changed |= kZOrder;
+    z_order_ = pending_.z_order;
+  }
+  if ((written & kBlendMode) != 0) {
+    if (blend_mode_ != pending_.blend_mode)
+      changed |= kBlendMode;
+    blend_mode_ = pending_.blend_mode;
+  }
+  if ((written & kDataspace) != 0) {
+    if (color_space_ != pending_.color_space ||
+        sample_range_ != pending_.sample_range)
+      changed |= kDataspace;
+    color_space_ = pending_.color_space;
+    sample_range_ = pending_.sample_range;
+  }
+  if ((written & kDisplayFrame) != 0) {
+    if (!IsSameRect(pi.display_frame, pending_.pi.display_frame))
+      changed |= kDisplayFrame;
+    pi.display_frame = pending_.pi.display_frame;
+  }
+  if ((written & kSourceCrop) != 0) {
+    if (!IsSameRect(pi.source_crop, pending_.pi.source_crop))
+      changed |= kSourceCrop;
+    pi.source_crop = pending_.pi.source_crop;
+  }
+  if ((written & kPlaneAlpha) != 0) {
+    if (pi.alpha != pending_.pi.alpha)
+      changed |= kPlaneAlpha;
+    pi.alpha = pending_.pi.alpha;
+  }
+  if ((written & kTransform) != 0) {
+    if (pi.transform != pending_.pi.transform)
+      changed |= kTransform;
+    pi.transform = pending_.pi.transform;
+  }
+
+  changed_ |= changed;
+}
+
 void HwcLayer::ImportFb() {
   if (!IsLayerUsableAsDevice() || !buffer_handle_updated_) {
     return;
@@ -45,18 +45,68 @@ class HwcLayer {
     return sf_type_ != validated_type_;
   }
 
-  bool GetPriorBufferScanOutFlag() const {
-    return prior_buffer_scanout_flag_;
+  /* Called once the frame is presented. Prior buffer needs the release fence
+   * only if it was scanned out and has been replaced by this frame. */
+  void UpdatePresentedFb(bool scanned_out) {
+    auto fb = scanned_out ? layer_data_.fb : nullptr;
+    release_fence_pending_ = presented_fb_ && presented_fb_ != fb;
+    presented_fb_ = std::move(fb);
   }
 
-  void SetPriorBufferScanOutFlag(bool state) {
-    prior_buffer_scanout_flag_ = state;
+  bool IsReleaseFencePending() const {
+    return release_fence_pending_;
   }
 
   uint32_t GetZOrder() const {
     return z_order_;
   }
 
+  /* Properties changed since the last ValidateDisplay() */
+  enum ChangedProperty : uint32_t {
+    kBuffer = 1 << 0,
+    kCompositionType = 1 << 1,
+    kZOrder = 1 << 2,
+    kBlendMode = 1 << 3,
+    kDataspace = 1 << 4,
+    kDisplayFrame = 1 << 5,
+    kSourceCrop = 1 << 6,
+    kPlaneAlpha = 1 << 7,
+    kTransform = 1 << 8,
+    kAllProperties = (1 << 9) - 1,
+  };
+
+  auto GetChangedProperties() const {
+    return changed_;
+  }
+
+  /* Set when any property affecting the composition except the buffer is
+   * changed. Buffer updates can be applied to a validated composition.
+   */
+  bool IsStateChanged() const {
+    return (changed_ & ~kBuffer) != 0;
+  }
+
+  void ClearStateChanged() {
+    changed_ = 0;
+  }
+
+  /* Applies the properties set by the layer hooks since the last latch and
+   * records the ones which have changed. Layer hooks write the pending state
+   * under the layers lock of the display, which the caller must hold. */
+  void Latch();
+
+  /* Records the time of the last content update, composition type requests
+   * don't count. Called by ValidateDisplay() before clearing the state. */
+  void LatchUpdateTime(int64_t time_ns) {
+    if ((changed_ & ~kCompositionType) != 0) {
+      last_update_ns_ = time_ns;
+    }
+  }
+
+  auto GetLastUpdateNs() const {
+    return last_update_ns_;
+  }
+
   auto &GetLayerData() {
     return layer_data_;
   }
@@ -99,7 +149,26 @@ class HwcLayer {
   buffer_handle_t buffer_handle_{};
   bool buffer_handle_updated_{};
 
-  bool prior_buffer_scanout_flag_{};
+  /* Properties set by the layer hooks, applied by Latch() */
+  struct PendingState {
+    uint32_t written{};
+    HWC2::Composition sf_type = HWC2::Composition::Invalid;
+    uint32_t z_order{};
+    BufferBlendMode blend_mode{};
+    BufferColorSpace color_space{};
+    BufferSampleRange sample_range{};
+    PresentInfo pi;
+    buffer_handle_t buffer_handle{};
+    SharedFd acquire_fence;
+  } pending_;
+
+  /* Framebuffer scanned out by the last presented frame */
+  std::shared_ptr<DrmFbIdHandle> presented_fb_;
+  bool release_fence_pending_{};
+
+  /* New layer counts as changed */
+  uint32_t changed_ = kAllProperties;
+  int64_t last_update_ns_{};
 
   HwcDisplay *const parent_;
 
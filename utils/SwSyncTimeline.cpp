@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-sw-sync-timeline"
+
+#include "SwSyncTimeline.h"
+
+#include <linux/types.h>
+#include <sys/ioctl.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdio>
+
+#include "utils/log.h"
+
+/* Not exported by the uapi headers, see drivers/dma-buf/sw_sync.c */
+struct sw_sync_create_fence_data {
+  __u32 value;
+  char name[32];  // NOLINT(modernize-avoid-c-arrays)
+  __s32 fence;
+};
+
+// NOLINTBEGIN(cppcoreguidelines-macro-usage)
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE \
+  _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, __u32)
+// NOLINTEND(cppcoreguidelines-macro-usage)
+
+namespace android {
+
+auto SwSyncTimeline::CreateInstance(const char *name)
+    -> std::unique_ptr<SwSyncTimeline> {
+  constexpr std::array<const char *, 2> kPaths = {
+      "/dev/sw_sync",
+      "/sys/kernel/debug/sync/sw_sync",
+  };
+
+  for (const auto *path : kPaths) {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg)
+    auto fd = MakeUniqueFd(open(path, O_RDWR | O_CLOEXEC));
+    if (fd) {
+      auto timeline = std::unique_ptr<SwSyncTimeline>(new SwSyncTimeline());
+      timeline->fd_ = std::move(fd);
+      timeline->name_ = name;
+      return timeline;
+    }
+  }
+
+  ALOGE("Failed to open sw_sync timeline, errno: %i", errno);
+  return {};
+}
+
+auto SwSyncTimeline::CreateFence(uint32_t point) -> SharedFd {
+  sw_sync_create_fence_data data{};
+  data.value = point;
+  snprintf(data.name, sizeof(data.name), "%s-%u", name_, point);
+
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg)
+  if (ioctl(*fd_, SW_SYNC_IOC_CREATE_FENCE, &data) != 0) {
+    ALOGE("Failed to create sw_sync fence, errno: %i", errno);
+    return {};
+  }
+
+  return MakeSharedFd(data.fence);
+}
+
+auto SwSyncTimeline::SignalUpTo(uint32_t point) -> int {
+  /* Wrap-around safe comparison */
+  if (int32_t(point - value_) <= 0) {
+    return 0;
+  }
+
+  __u32 inc = point - value_;
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg)
+  if (ioctl(*fd_, SW_SYNC_IOC_INC, &inc) != 0) {
+    ALOGE("Failed to advance sw_sync timeline, errno: %i", errno);
+    return -errno;
+  }
+
+  value_ = point;
+  return 0;
+}
+
+}  // namespace android
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "fd.h"
+
+namespace android {
+
+/* Software sync timeline. Fences created on the timeline signal once the
+ * timeline value reaches their point. Closing the timeline signals all the
+ * pending fences. */
+class SwSyncTimeline {
+ public:
+  /* |name| is used as a prefix of the fence names */
+  static auto CreateInstance(const char *name)
+      -> std::unique_ptr<SwSyncTimeline>;
+
+  auto CreateFence(uint32_t point) -> SharedFd;
+
+  /* Advances the timeline up to the point, does nothing if already there */
+  auto SignalUpTo(uint32_t point) -> int;
+
+  auto GetValue() const {
+    return value_;
+  }
+
+ private:
+  SwSyncTimeline() = default;
+
+  UniqueFd fd_ = MakeUniqueFd(-1);
+  const char *name_{};
+  uint32_t value_{};
+};
+
+}  // namespace android
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-timer-service"
+
+#include "TimerService.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <ctime>
+#include <thread>
+
+#include "utils/log.h"
+
+namespace android {
+
+constexpr int64_t kNsInSec = 1000000000LL;
+
+auto TimerService::CreateInstance() -> std::shared_ptr<TimerService> {
+  auto service = std::shared_ptr<TimerService>(new TimerService());
+
+  service->timer_fd_ = MakeUniqueFd(
+      timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+  service->epoll_fd_ = MakeUniqueFd(epoll_create1(EPOLL_CLOEXEC));
+  service->exit_fd_ = MakeUniqueFd(eventfd(0, EFD_CLOEXEC));
+  if (!service->timer_fd_ || !service->epoll_fd_ || !service->exit_fd_) {
+    ALOGE("Failed to create the timer service, errno: %i", errno);
+    return {};
+  }
+
+  for (const int fd : {*service->timer_fd_, *service->exit_fd_}) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(*service->epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      ALOGE("Failed to add fd %i to epoll, errno: %i", fd, errno);
+      return {};
+    }
+  }
+
+  std::thread(&TimerService::ThreadFn, service.get(), service).detach();
+
+  return service;
+}
+
+auto TimerService::GetTimeNs() -> int64_t {
+  struct timespec ts {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return int64_t(ts.tv_sec) * kNsInSec + int64_t(ts.tv_nsec);
+}
+
+auto TimerService::Schedule(int64_t time_ns, Callback callback) -> TimerId {
+  /* Zero is reserved for the disarmed timerfd */
+  time_ns = std::max(time_ns, int64_t(1));
+
+  const std::unique_lock lock(mutex_);
+  const TimerId id = ++last_id_;
+  timers_.emplace(time_ns, Timer{.id = id, .callback = std::move(callback)});
+  Rearm();
+  return id;
+}
+
+void TimerService::Cancel(TimerId id) {
+  const std::unique_lock lock(mutex_);
+  for (auto it = timers_.begin(); it != timers_.end(); ++it) {
+    if (it->second.id == id) {
+      timers_.erase(it);
+      Rearm();
+      return;
+    }
+  }
+}
+
+void TimerService::StopThread() {
+  const uint64_t value = 1;
+  if (write(*exit_fd_, &value, sizeof(value)) != sizeof(value)) {
+    ALOGE("Failed to stop the timer service, errno: %i", errno);
+  }
+}
+
+void TimerService::Rearm() {
+  /* Zero disarms the timer */
+  const int64_t next_ns = timers_.empty() ? 0 : timers_.begin()->first;
+  if (next_ns == armed_ns_) {
+    return;
+  }
+
+  /* Deadlines in the past fire right away */
+  itimerspec spec{};
+  spec.it_value.tv_sec = next_ns / kNsInSec;
+  spec.it_value.tv_nsec = next_ns % kNsInSec;
+
+  if (timerfd_settime(*timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) != 0) {
+    ALOGE("Failed to arm the timer, errno: %i", errno);
+    return;
+  }
+
+  armed_ns_ = next_ns;
+}
+
+void TimerService::ThreadFn(
+    const std::shared_ptr<TimerService> & /*timer_service*/) {
+  for (;;) {
+    std::array<epoll_event, 2> events{};
+    auto count = epoll_wait(*epoll_fd_, events.data(), int(events.size()), -1);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+
+      ALOGE("epoll_wait failed, errno: %i", errno);
+      break;
+    }
+
+    bool exit = false;
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.fd == *exit_fd_) {
+        exit = true;
+      }
+    }
+
+    if (exit)
+      break;
+
+    uint64_t expirations = 0;
+    /* Nothing to read if the timer was re-armed meanwhile */
+    (void)!read(*timer_fd_, &expirations, sizeof(expirations));
+
+    {
+      const std::unique_lock lock(mutex_);
+      const int64_t now_ns = GetTimeNs();
+      while (!timers_.empty() && timers_.begin()->first <= now_ns) {
+        auto node = timers_.extract(timers_.begin());
+        due_.emplace_back(node.key(), std::move(node.mapped().callback));
+      }
+
+      /* Deadline has passed, the timer has to be re-armed even if the
+       * earliest deadline didn't change */
+      armed_ns_ = 0;
+      Rearm();
+    }
+
+    for (auto &[time_ns, callback] : due_) {
+      callback(time_ns);
+    }
+    due_.clear();
+  }
+
+  ALOGI("TimerService thread exit");
+}
+
+}  // namespace android
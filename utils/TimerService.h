@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "fd.h"
+
+namespace android {
+
+/* Single thread serving all the one-shot timers of the process, armed on one
+ * timerfd at the earliest deadline. Callbacks are called from the service
+ * thread without any lock held and may schedule new timers.
+ */
+class TimerService {
+ public:
+  using TimerId = uint64_t;
+  using Callback = std::function<void(int64_t /*time_ns*/)>;
+
+  static auto CreateInstance() -> std::shared_ptr<TimerService>;
+
+  /* Calls |callback| at the CLOCK_MONOTONIC |time_ns|, immediately if it is
+   * in the past. */
+  auto Schedule(int64_t time_ns, Callback callback) -> TimerId;
+
+  /* Callback which is already running isn't waited for */
+  void Cancel(TimerId id);
+
+  void StopThread();
+
+  static auto GetTimeNs() -> int64_t;
+
+ private:
+  TimerService() = default;
+
+  void ThreadFn(const std::shared_ptr<TimerService> &timer_service);
+  /* Arms the timerfd at the earliest deadline, mutex_ held */
+  void Rearm();
+
+  struct Timer {
+    TimerId id;
+    Callback callback;
+  };
+
+  std::multimap<int64_t /*time_ns*/, Timer> timers_;
+  TimerId last_id_{};
+  int64_t armed_ns_{};
+
+  /* Scratch storage of the service thread */
+  std::vector<std::pair<int64_t, Callback>> due_;
+
+  UniqueFd timer_fd_ = MakeUniqueFd(-1);
+  UniqueFd epoll_fd_ = MakeUniqueFd(-1);
+  /* Wakes up the thread on exit */
+  UniqueFd exit_fd_ = MakeUniqueFd(-1);
+
+  std::mutex mutex_;
+};
+
+}  // namespace android
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-vsync-model"
+
+#include "VSyncModel.h"
+
+#include <cstdlib>
+
+#include "utils/log.h"
+
+namespace android {
+
+/* Deviations are in the fractions of the period */
+constexpr int64_t kOutlierDivisor = 4;
+constexpr int64_t kLockedDivisor = 100;
+constexpr int kOutliersToReset = 3;
+constexpr int kSamplesToLock = 6;
+/* Inverse gains of the phase and the period loops */
+constexpr int64_t kPhaseGainDivisor = 4;
+constexpr int64_t kPeriodGainDivisor = 16;
+/* Gap after which the phase is taken from the sample as is. Period error
+ * accumulated over the gap says nothing about the period. */
+constexpr int64_t kResyncGapPeriods = 120;
+
+void VSyncModel::SetNominalPeriod(int64_t period_ns) {
+  if (period_ns <= 0 || period_ns == nominal_period_ns_) {
+    return;
+  }
+
+  /* New timing starts at the vsync following the last accepted one, keep
+   * predicting from there until the samples of the new mode arrive */
+  const int64_t anchor_ns = anchor_ns_ != 0 ? anchor_ns_ + period_ns_ : 0;
+
+  nominal_period_ns_ = period_ns;
+  period_ns_ = period_ns;
+  Reset();
+  anchor_ns_ = anchor_ns;
+}
+
+void VSyncModel::Reset() {
+  anchor_ns_ = 0;
+  good_samples_ = 0;
+  outliers_ = 0;
+  locked_ = false;
+}
+
+void VSyncModel::AddSample(int64_t timestamp_ns) {
+  if (period_ns_ <= 0) {
+    return;
+  }
+
+  if (anchor_ns_ == 0) {
+    anchor_ns_ = timestamp_ns;
+    return;
+  }
+
+  const int64_t since_anchor_ns = timestamp_ns - anchor_ns_;
+  const int64_t periods = (since_anchor_ns + period_ns_ / 2) / period_ns_;
+  if (periods <= 0) {
+    /* Duplicate or out of order */
+    return;
+  }
+
+  if (periods > kResyncGapPeriods) {
+    anchor_ns_ = timestamp_ns;
+    good_samples_ = 0;
+    locked_ = false;
+    return;
+  }
+
+  const int64_t error_ns = since_anchor_ns - periods * period_ns_;
+  if (std::abs(error_ns) > period_ns_ / kOutlierDivisor) {
+    if (++outliers_ >= kOutliersToReset) {
+      ALOGV("Vsync timing changed, re-syncing");
+      Reset();
+      anchor_ns_ = timestamp_ns;
+    }
+    return;
+  }
+  outliers_ = 0;
+
+  anchor_ns_ += periods * period_ns_ + error_ns / kPhaseGainDivisor;
+  period_ns_ += error_ns / periods / kPeriodGainDivisor;
+
+  /* Don't drift away from the mode */
+  const int64_t max_drift_ns = nominal_period_ns_ / kOutlierDivisor;
+  if (nominal_period_ns_ != 0 &&
+      std::abs(period_ns_ - nominal_period_ns_) > max_drift_ns) {
+    period_ns_ = nominal_period_ns_;
+  }
+
+  if (std::abs(error_ns) < period_ns_ / kLockedDivisor) {
+    locked_ = ++good_samples_ >= kSamplesToLock;
+  } else {
+    good_samples_ = 0;
+    locked_ = false;
+  }
+}
+
+auto VSyncModel::PredictNextVSync(int64_t time_ns) const -> int64_t {
+  if (anchor_ns_ == 0 || period_ns_ <= 0) {
+    return 0;
+  }
+
+  const int64_t since_anchor_ns = time_ns - anchor_ns_;
+  if (since_anchor_ns < 0) {
+    return anchor_ns_;
+  }
+
+  return anchor_ns_ + (since_anchor_ns / period_ns_ + 1) * period_ns_;
+}
+
+}  // namespace android
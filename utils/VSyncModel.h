@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace android {
+
+/* Software PLL tracking the period and the phase of the hardware vsync.
+ * Each timestamp corrects the phase and, more slowly, the period, so the
+ * model keeps predicting the vsync while the hardware events are off.
+ * Samples far off the prediction are rejected unless they keep coming, which
+ * means the timing has changed.
+ */
+class VSyncModel {
+ public:
+  /* Period of the active mode. If it changes, the model re-locks keeping
+   * the phase of the last accepted vsync. */
+  void SetNominalPeriod(int64_t period_ns);
+
+  void AddSample(int64_t timestamp_ns);
+
+  /* First vsync after |time_ns|, 0 if the model has no reference yet */
+  auto PredictNextVSync(int64_t time_ns) const -> int64_t;
+
+  auto GetPeriodNs() const {
+    return period_ns_;
+  }
+
+  /* Enough consecutive samples matched the prediction */
+  auto IsLocked() const {
+    return locked_;
+  }
+
+ private:
+  void Reset();
+
+  int64_t nominal_period_ns_{};
+  int64_t period_ns_{};
+  /* Timestamp of the last accepted vsync */
+  int64_t anchor_ns_{};
+
+  int good_samples_{};
+  int outliers_{};
+  bool locked_{};
+};
+
+}  // namespace android